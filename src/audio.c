@@ -0,0 +1,320 @@
+#define _POSIX_C_SOURCE 200809L // Needed for semaphores
+
+#include "audio.h"
+#include "chip8.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RING_SIZE 4 // frames the emulation can queue ahead of the audio thread, about 67 ms
+#define AMPLITUDE 8000
+#define SQUARE_FREQUENCY 440 // buzzer tone until a pattern is loaded
+#define PATTERN_BITS (8 * PATTERN_SIZE)
+#define PATTERN_RATE 4000.0 // pattern bits per second at the default pitch
+#define PITCH_STEP 1.0145453349375237 // 2^(1/48), the pitch counts 48ths of an octave
+#define WAV_HEADER_SIZE 44
+#define WAV_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+  uint8_t on; // ST was non-zero
+  uint8_t pitch;
+  uint8_t pattern[PATTERN_SIZE];
+} AudioFrame;
+
+struct AudioEngine {
+  AudioSink* sink;
+  pthread_t thread;
+  AudioFrame ring[RING_SIZE];
+  unsigned int head; // frames pushed, written by the emulation thread only
+  unsigned int tail; // frames rendered, owned by the audio thread
+  sem_t filled; // frames waiting in the ring, one extra post stops the thread
+  sem_t room; // free slots
+  long dropped; // owned by the emulation thread
+
+  // Audio thread only
+  double phase; // position in the pattern in bits, in periods for the square wave
+  double rates[256]; // pattern bits per sample for every pitch
+  int failed;
+  int16_t samples[AUDIO_FRAME_SAMPLES];
+};
+
+typedef struct {
+  AudioSink sink;
+  FILE* fp;
+  uint32_t bytes; // sample data written so far
+  char buffer[WAV_BUFFER_SIZE];
+} WavSink;
+
+typedef struct {
+  AudioSink sink;
+  int sounding; // the previous block was not silent
+} BellSink;
+
+static void* audio_main(void* arg);
+static void render(AudioEngine* audio, const AudioFrame* frame);
+static int null_write(AudioSink* sink, const int16_t* samples, int count);
+static int null_close(AudioSink* sink);
+static int wav_write(AudioSink* sink, const int16_t* samples, int count);
+static int wav_close(AudioSink* sink);
+static int bell_write(AudioSink* sink, const int16_t* samples, int count);
+static int bell_close(AudioSink* sink);
+static void put_u16(uint8_t* p, uint16_t value);
+static void put_u32(uint8_t* p, uint32_t value);
+
+
+AudioSink* audio_null_sink() {
+  AudioSink* sink = malloc(sizeof(AudioSink));
+  if (!sink) {
+    return NULL;
+  }
+  sink->write = null_write;
+  sink->close = null_close;
+  sink->lossless = 1;
+  return sink;
+}
+
+AudioSink* audio_wav_sink(const char* filename) {
+  assert(filename);
+  WavSink* wav = malloc(sizeof(WavSink));
+  if (!wav) {
+    return NULL;
+  }
+  wav->fp = fopen(filename, "wb");
+  if (!wav->fp) {
+    free(wav);
+    return NULL;
+  }
+  setvbuf(wav->fp, wav->buffer, _IOFBF, WAV_BUFFER_SIZE);
+  wav->bytes = 0;
+  wav->sink.write = wav_write;
+  wav->sink.close = wav_close;
+  wav->sink.lossless = 1;
+
+  // Sizes are filled in by wav_close
+  uint8_t header[WAV_HEADER_SIZE] = {'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E',
+                                     'f', 'm', 't', ' ', 16, 0, 0, 0, 1, 0, 1, 0};
+  put_u32(header + 24, AUDIO_SAMPLE_RATE);
+  put_u32(header + 28, AUDIO_SAMPLE_RATE * 2);
+  put_u16(header + 32, 2);
+  put_u16(header + 34, 16);
+  memcpy(header + 36, "data", 4);
+  fwrite(header, 1, sizeof(header), wav->fp);
+  return &wav->sink;
+}
+
+AudioSink* audio_bell_sink() {
+  BellSink* bell = malloc(sizeof(BellSink));
+  if (!bell) {
+    return NULL;
+  }
+  bell->sounding = 0;
+  bell->sink.write = bell_write;
+  bell->sink.close = bell_close;
+  bell->sink.lossless = 0;
+  return &bell->sink;
+}
+
+AudioEngine* audio_create(AudioSink* sink) {
+  if (!sink) {
+    return NULL;
+  }
+  AudioEngine* audio = calloc(1, sizeof(AudioEngine));
+  if (!audio) {
+    sink->close(sink);
+    return NULL;
+  }
+  audio->sink = sink;
+
+  // Pitch 64 plays PATTERN_RATE bits per second, every 48 steps double it
+  audio->rates[64] = PATTERN_RATE / AUDIO_SAMPLE_RATE;
+  for (int pitch = 65; pitch < 256; pitch++) {
+    audio->rates[pitch] = audio->rates[pitch - 1] * PITCH_STEP;
+  }
+  for (int pitch = 63; pitch >= 0; pitch--) {
+    audio->rates[pitch] = audio->rates[pitch + 1] / PITCH_STEP;
+  }
+
+  sem_init(&audio->filled, 0, 0);
+  sem_init(&audio->room, 0, RING_SIZE);
+  if (pthread_create(&audio->thread, NULL, audio_main, audio)) {
+    sem_destroy(&audio->filled);
+    sem_destroy(&audio->room);
+    sink->close(sink);
+    free(audio);
+    return NULL;
+  }
+  return audio;
+}
+
+int audio_destroy(AudioEngine* audio) {
+  if (!audio) {
+    return 0;
+  }
+  // A post without a frame tells the thread the ring is done
+  sem_post(&audio->filled);
+  pthread_join(audio->thread, NULL);
+  sem_destroy(&audio->filled);
+  sem_destroy(&audio->room);
+  int failed = audio->failed;
+  failed |= audio->sink->close(audio->sink);
+  free(audio);
+  return failed ? 1 : 0;
+}
+
+void audio_push(AudioEngine* audio, const Chip8* chip) {
+  assert(audio);
+  assert(chip);
+  // Realtime sinks rather lose a frame than hold up the emulation
+  if (audio->sink->lossless) {
+    while (sem_wait(&audio->room)) {
+    }
+  } else if (sem_trywait(&audio->room)) {
+    audio->dropped++;
+    return;
+  }
+  AudioFrame* frame = &audio->ring[audio->head % RING_SIZE];
+  frame->on = chip->ST != 0;
+  frame->pitch = chip->pitch;
+  memcpy(frame->pattern, chip->pattern, PATTERN_SIZE);
+  __atomic_store_n(&audio->head, audio->head + 1, __ATOMIC_RELEASE);
+  sem_post(&audio->filled);
+}
+
+long audio_dropped(const AudioEngine* audio) {
+  assert(audio);
+  return audio->dropped;
+}
+
+
+// ----
+// Static functions
+
+static void* audio_main(void* arg) {
+  AudioEngine* audio = arg;
+  for (;;) {
+    while (sem_wait(&audio->filled)) {
+    }
+    if (audio->tail == __atomic_load_n(&audio->head, __ATOMIC_ACQUIRE)) {
+      return NULL;
+    }
+    render(audio, &audio->ring[audio->tail % RING_SIZE]);
+    audio->tail++;
+    sem_post(&audio->room);
+    if (!audio->failed && audio->sink->write(audio->sink, audio->samples, AUDIO_FRAME_SAMPLES)) {
+      audio->failed = 1;
+    }
+  }
+}
+
+static void render(AudioEngine* audio, const AudioFrame* frame) {
+  // Every tone starts at the beginning of its waveform
+  if (!frame->on) {
+    memset(audio->samples, 0, sizeof(audio->samples));
+    audio->phase = 0;
+    return;
+  }
+
+  int loaded = 0;
+  for (int i = 0; i < PATTERN_SIZE; i++) {
+    loaded |= frame->pattern[i];
+  }
+  if (!loaded) {
+    double rate = (double)SQUARE_FREQUENCY / AUDIO_SAMPLE_RATE;
+    for (int i = 0; i < AUDIO_FRAME_SAMPLES; i++) {
+      audio->samples[i] = audio->phase < 0.5 ? AMPLITUDE : -AMPLITUDE;
+      audio->phase += rate;
+      if (audio->phase >= 1.0) {
+        audio->phase -= 1.0;
+      }
+    }
+    return;
+  }
+
+  double rate = audio->rates[frame->pitch];
+  for (int i = 0; i < AUDIO_FRAME_SAMPLES; i++) {
+    int bit = (int)audio->phase;
+    audio->samples[i] = (frame->pattern[bit / 8] >> (7 - bit % 8)) & 1 ? AMPLITUDE : -AMPLITUDE;
+    audio->phase += rate;
+    if (audio->phase >= PATTERN_BITS) {
+      audio->phase -= PATTERN_BITS;
+    }
+  }
+}
+
+static int null_write(AudioSink* sink, const int16_t* samples, int count) {
+  (void)sink;
+  (void)samples;
+  (void)count;
+  return 0;
+}
+
+static int null_close(AudioSink* sink) {
+  free(sink);
+  return 0;
+}
+
+static int wav_write(AudioSink* sink, const int16_t* samples, int count) {
+  WavSink* wav = (WavSink*)sink;
+  uint8_t bytes[2 * AUDIO_FRAME_SAMPLES];
+  while (count > 0) {
+    int chunk = count < AUDIO_FRAME_SAMPLES ? count : AUDIO_FRAME_SAMPLES;
+    for (int i = 0; i < chunk; i++) {
+      put_u16(bytes + 2 * i, (uint16_t)samples[i]);
+    }
+    if (fwrite(bytes, 2, chunk, wav->fp) != (size_t)chunk) {
+      return 1;
+    }
+    wav->bytes += 2 * chunk;
+    samples += chunk;
+    count -= chunk;
+  }
+  return 0;
+}
+
+static int wav_close(AudioSink* sink) {
+  WavSink* wav = (WavSink*)sink;
+  uint8_t size[4];
+  put_u32(size, WAV_HEADER_SIZE - 8 + wav->bytes);
+  int failed = fseek(wav->fp, 4, SEEK_SET) != 0 || fwrite(size, 1, 4, wav->fp) != 4;
+  put_u32(size, wav->bytes);
+  failed |= fseek(wav->fp, 40, SEEK_SET) != 0 || fwrite(size, 1, 4, wav->fp) != 4;
+  failed |= ferror(wav->fp) != 0;
+  failed |= fclose(wav->fp) != 0;
+  free(wav);
+  return failed ? 1 : 0;
+}
+
+static int bell_write(AudioSink* sink, const int16_t* samples, int count) {
+  BellSink* bell = (BellSink*)sink;
+  int sounding = 0;
+  for (int i = 0; i < count; i++) {
+    sounding |= samples[i] != 0;
+  }
+  if (sounding && !bell->sounding) {
+    fputc('\a', stderr);
+    fflush(stderr);
+  }
+  bell->sounding = sounding;
+  return 0;
+}
+
+static int bell_close(AudioSink* sink) {
+  free(sink);
+  return 0;
+}
+
+static void put_u16(uint8_t* p, uint16_t value) {
+  p[0] = value & 0xFF;
+  p[1] = value >> 8;
+}
+
+static void put_u32(uint8_t* p, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
@@ -0,0 +1,46 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include "chip8.h"
+
+#include <stdint.h>
+
+// Sound of the machine. The emulation thread pushes the sound state of
+// every 60Hz frame into a lock-free single producer, single consumer ring,
+// an audio thread renders the samples of each frame and hands them to a
+// sink. The buzzer sounds while ST is non-zero, with the XO-CHIP pattern at
+// its pitch once a pattern was loaded, a square wave before.
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_FRAME_SAMPLES (AUDIO_SAMPLE_RATE / 60)
+
+// Where rendered samples go, called from the audio thread only
+typedef struct AudioSink AudioSink;
+struct AudioSink {
+  // Plays count mono samples, returns 1 when the output failed. Devices
+  // block here until there is room, which paces the audio thread.
+  int (*write)(AudioSink* sink, const int16_t* samples, int count);
+  // Flushes and frees the sink, returns 1 when the output failed
+  int (*close)(AudioSink* sink);
+  int lossless; // the emulation waits for room instead of dropping frames
+};
+
+// Discards the samples, for running the audio path without output
+AudioSink* audio_null_sink();
+// Writes 16-bit mono PCM, the header is completed when the sink closes
+AudioSink* audio_wav_sink(const char* filename);
+// Rings the terminal bell on stderr whenever the buzzer starts
+AudioSink* audio_bell_sink();
+
+typedef struct AudioEngine AudioEngine;
+
+// Takes ownership of sink, returns NULL and closes it on failure
+AudioEngine* audio_create(AudioSink* sink);
+// Renders the rest of the frames, stops the thread and closes the sink.
+// Returns 1 when the sink failed.
+int audio_destroy(AudioEngine* audio);
+// Queues the sound of the frame chip just ran, call before its timer tick
+void audio_push(AudioEngine* audio, const Chip8* chip);
+// Frames dropped because the ring was full
+long audio_dropped(const AudioEngine* audio);
+
+#endif
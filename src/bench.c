@@ -0,0 +1,308 @@
+#define _POSIX_C_SOURCE 200809L // Needed for getopt and clock_gettime
+
+#include "chip8.h"
+#include "jit.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_INSTRUCTIONS 20000000L
+#define DEFAULT_REPETITIONS 5
+#define TICK_INTERVAL 1000 // instructions between timer ticks
+
+// A benchmark is a small ROM looping forever, timed over a fixed number of
+// instructions. Micro ROMs loop over one opcode family, macro ROMs are
+// small synthetic programs mixing them the way games do.
+typedef struct {
+  const char* name;
+  const char* kind; // "micro" or "macro"
+  const uint8_t* rom;
+  size_t size;
+} Benchmark;
+
+typedef struct {
+  long instructions; // per repetition
+  int repetitions;
+  int interpreter;
+  int jit;
+  const char* filter; // only benchmarks with this name, NULL for all
+} Options;
+
+// 8xyN with all ALU operations, then a jump back
+static const uint8_t rom_alu[] = {
+  0x60, 0x13, 0x61, 0x57, // LD V0, 13 / LD V1, 57
+  0x80, 0x14, 0x80, 0x15, 0x80, 0x11, 0x80, 0x12, // ADD SUB OR AND
+  0x80, 0x13, 0x80, 0x16, 0x80, 0x1E, 0x80, 0x17, // XOR SHR SHL SUBN
+  0x80, 0x10, 0x12, 0x04 // LD V0, V1 / JP 204
+};
+
+// DRW of an 8x5 sprite stepping across the screen
+static const uint8_t rom_draw[] = {
+  0xA2, 0x10, // LD I, 210
+  0xD0, 0x15, // DRW V0, V1, 5
+  0x70, 0x03, // ADD V0, 3
+  0x71, 0x01, // ADD V1, 1
+  0x12, 0x02, // JP 202
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xF0, 0x90, 0xF0, 0x90, 0xF0
+};
+
+// Fx55 and Fx65 of all registers
+static const uint8_t rom_memory[] = {
+  0xA3, 0x00, // LD I, 300
+  0xFF, 0x55, // LD [I], VF
+  0xA3, 0x00, // LD I, 300
+  0xFF, 0x65, // LD VF, [I]
+  0x12, 0x00 // JP 200
+};
+
+// Skips taken and not taken
+static const uint8_t rom_branch[] = {
+  0x30, 0x01, // SE V0, 1
+  0x40, 0x00, // SNE V0, 0
+  0x50, 0x10, // SE V0, V1
+  0x00, 0x00, // skipped
+  0x90, 0x10, // SNE V0, V1
+  0x12, 0x00 // JP 200
+};
+
+// CALL and RET
+static const uint8_t rom_call[] = {
+  0x22, 0x04, // CALL 204
+  0x12, 0x00, // JP 200
+  0x22, 0x08, // CALL 208
+  0x00, 0xEE, // RET
+  0x00, 0xEE // RET
+};
+
+// A frame of a game: clear, a row of sprites, a delay timer wait, a score
+// in BCD and a row counter
+static const uint8_t rom_game[] = {
+  0x61, 0x08, // 200: LD V1, 8
+  0x00, 0xE0, // 202: CLS
+  0x60, 0x00, // 204: LD V0, 0
+  0xA2, 0x40, // 206: LD I, 240
+  0xD0, 0x15, // 208: DRW V0, V1, 5
+  0x70, 0x08, // 20A: ADD V0, 8
+  0x30, 0x40, // 20C: SE V0, 40
+  0x12, 0x08, // 20E: JP 208
+  0x62, 0x03, // 210: LD V2, 3
+  0xF2, 0x15, // 212: LD DT, V2
+  0xF2, 0x07, // 214: LD V2, DT
+  0x32, 0x00, // 216: SE V2, 0
+  0x12, 0x14, // 218: JP 214
+  0x71, 0x01, // 21A: ADD V1, 1
+  0xA3, 0x00, // 21C: LD I, 300
+  0xF1, 0x33, // 21E: LD B, V1
+  0xF0, 0x65, // 220: LD V0, [I]
+  0x41, 0x19, // 222: SNE V1, 19
+  0x61, 0x00, // 224: LD V1, 0
+  0x12, 0x02, // 226: JP 202
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xF0, 0x90, 0xF0, 0x90, 0xF0 // 240: sprite
+};
+
+// SUPER-CHIP: 16x16 sprites in high resolution with scrolling
+static const uint8_t rom_hires[] = {
+  0x00, 0xFF, // 200: HIGH
+  0xA2, 0x20, // 202: LD I, 220
+  0x60, 0x00, // 204: LD V0, 0
+  0x61, 0x00, // 206: LD V1, 0
+  0xD0, 0x10, // 208: DRW V0, V1, 0
+  0x00, 0xC2, // 20A: SCD 2
+  0x00, 0xFB, // 20C: SCR
+  0x70, 0x05, // 20E: ADD V0, 5
+  0x71, 0x03, // 210: ADD V1, 3
+  0x12, 0x08, // 212: JP 208
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xFF, 0xFF, 0x80, 0x01, 0xBF, 0xFD, 0xA0, 0x05, // 220: sprite
+  0xAF, 0xF5, 0xA8, 0x15, 0xAB, 0xD5, 0xAA, 0x55,
+  0xAA, 0x55, 0xAB, 0xD5, 0xA8, 0x15, 0xAF, 0xF5,
+  0xA0, 0x05, 0xBF, 0xFD, 0x80, 0x01, 0xFF, 0xFF
+};
+
+// Arithmetic with results kept in memory and a subroutine per iteration
+static const uint8_t rom_compute[] = {
+  0x60, 0x00, // 200: LD V0, 0
+  0x61, 0x00, // 202: LD V1, 0
+  0x80, 0x14, // 204: ADD V0, V1
+  0x71, 0x01, // 206: ADD V1, 1
+  0xA3, 0x00, // 208: LD I, 300
+  0xF1, 0x55, // 20A: LD [I], V1
+  0xA3, 0x00, // 20C: LD I, 300
+  0xF1, 0x65, // 20E: LD V1, [I]
+  0x22, 0x14, // 210: CALL 214
+  0x12, 0x04, // 212: JP 204
+  0x82, 0x06, // 214: SHR V2, V0
+  0x82, 0x23, // 216: XOR V2, V2
+  0x00, 0xEE // 218: RET
+};
+
+#define BENCHMARK(name, kind) {#name, kind, rom_##name, sizeof(rom_##name)}
+
+static const Benchmark benchmarks[] = {
+  BENCHMARK(alu, "micro"),
+  BENCHMARK(draw, "micro"),
+  BENCHMARK(memory, "micro"),
+  BENCHMARK(branch, "micro"),
+  BENCHMARK(call, "micro"),
+  BENCHMARK(game, "macro"),
+  BENCHMARK(hires, "macro"),
+  BENCHMARK(compute, "macro")
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static int parse_options(int argc, char* argv[], Options* options);
+static void run_benchmark(const Benchmark* benchmark, Chip8Jit* jit, const Options* options);
+static double time_run(Chip8* chip, Chip8Jit* jit, long instructions);
+static double current_time_seconds();
+
+
+int main(int argc, char* argv[]) {
+  Options options = {
+    .instructions = DEFAULT_INSTRUCTIONS,
+    .repetitions = DEFAULT_REPETITIONS,
+    .interpreter = 1,
+    .jit = 1,
+    .filter = NULL
+  };
+  if (parse_options(argc, argv, &options)) {
+    printf("Usage: %s [-i instructions] [-r repetitions] [-b interpreter|jit|all] [benchmark]\n", argv[0]);
+    return 0;
+  }
+
+  Chip8Jit* jit = NULL;
+  if (options.jit) {
+    jit = chip8_jit_create();
+    if (!jit) {
+      fprintf(stderr, "JIT is not available on this host, skipping it\n");
+    }
+  }
+
+  int found = 0;
+  for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+    if (options.filter && strcmp(options.filter, benchmarks[i].name)) {
+      continue;
+    }
+    found = 1;
+    if (options.interpreter) {
+      run_benchmark(&benchmarks[i], NULL, &options);
+    }
+    if (jit) {
+      run_benchmark(&benchmarks[i], jit, &options);
+    }
+  }
+  chip8_jit_destroy(jit);
+
+  if (!found) {
+    printf("Unknown benchmark: %s\n", options.filter);
+    return -1;
+  }
+  return 0;
+}
+
+
+static int parse_options(int argc, char* argv[], Options* options) {
+  assert(options);
+  int opt;
+  while ((opt = getopt(argc, argv, "i:r:b:")) != -1) {
+    switch (opt) {
+      case 'i':
+        options->instructions = atol(optarg);
+        break;
+      case 'r':
+        options->repetitions = atoi(optarg);
+        break;
+      case 'b':
+        options->interpreter = !strcmp(optarg, "interpreter") || !strcmp(optarg, "all");
+        options->jit = !strcmp(optarg, "jit") || !strcmp(optarg, "all");
+        if (!options->interpreter && !options->jit) {
+          return 1;
+        }
+        break;
+      default:
+        return 1;
+    }
+  }
+  if (optind < argc - 1 || options->instructions <= 0 || options->repetitions < 1) {
+    return 1;
+  }
+  if (optind == argc - 1) {
+    options->filter = argv[optind];
+  }
+  return 0;
+}
+
+static void run_benchmark(const Benchmark* benchmark, Chip8Jit* jit, const Options* options) {
+  assert(benchmark);
+  assert(options);
+
+  // Every repetition starts from a fresh machine, the JIT translates again
+  static Chip8 chip;
+  double sum = 0;
+  double sum_squares = 0;
+  double best = 0;
+  for (int i = 0; i < options->repetitions; i++) {
+    chip8_init(&chip);
+    chip8_load_rom(&chip, benchmark->rom, benchmark->size);
+    if (jit) {
+      chip8_jit_flush(jit);
+    }
+
+    double ns = time_run(&chip, jit, options->instructions) * 1e9 / options->instructions;
+    sum += ns;
+    sum_squares += ns * ns;
+    if (i == 0 || ns < best) {
+      best = ns;
+    }
+  }
+
+  // ns per instruction over the repetitions, one JSON object per line
+  int n = options->repetitions;
+  double mean = sum / n;
+  double variance = (n > 1) ? (sum_squares - sum * mean) / (n - 1) : 0;
+  if (variance < 0) {
+    variance = 0;
+  }
+  printf("{\"benchmark\":\"%s\",\"kind\":\"%s\",\"backend\":\"%s\",\"instructions\":%ld,"
+         "\"repetitions\":%d,\"ips\":%.0f,\"ns_per_op\":%.4f,\"ns_per_op_min\":%.4f,"
+         "\"ns_per_op_stddev\":%.4f,\"ns_per_op_variance\":%.6f}\n",
+         benchmark->name, benchmark->kind, jit ? "jit" : "interpreter", options->instructions,
+         n, 1e9 / mean, mean, best, sqrt(variance), variance);
+  fflush(stdout);
+}
+
+static double time_run(Chip8* chip, Chip8Jit* jit, long instructions) {
+  double start = current_time_seconds();
+  long executed = 0;
+  while (executed < instructions) {
+    long batch = instructions - executed;
+    if (batch > TICK_INTERVAL) {
+      batch = TICK_INTERVAL;
+    }
+    if (jit) {
+      chip8_jit_run(jit, chip, batch);
+    } else {
+      for (long i = 0; i < batch; i++) {
+        chip8_step(chip);
+      }
+    }
+    chip8_timer_tick(chip);
+    executed += batch;
+  }
+  return current_time_seconds() - start;
+}
+
+static double current_time_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -1,25 +1,137 @@
 #include "chip8.h"
+#include "profile.h"
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <time.h>
-#include <stdlib.h>
+#include <string.h>
 
-#define PROGRAM_START_ADDRESS 0x200
-#define MAX_PROGRAM_SIZE 0xDFF
+#define MAX_PROGRAM_SIZE (MEMORY_SIZE - PROGRAM_START_ADDRESS)
 #define SPRITE_WIDTH 8
+#define BIG_FONT_ADDRESS 0x50 // SCHIP 8x10 digits, after the 4x5 ones
+#define DEFAULT_PITCH 64 // 4000Hz pattern playback
+#define SCROLL_PIXELS 4 // columns moved by 00FB and 00FC
+// Fields of a state blob checked before any of it is loaded
+#define STATE_SP_OFFSET (4 + 1 + REGISTERS_SIZE)
+#define STATE_HIRES_OFFSET (STATE_SP_OFFSET + 3 + 2 + 2 + 2 * STACK_SIZE + 8 + 2 + 2 + REGISTERS_SIZE \
+                            + PATTERN_SIZE + 1)
+#define STATE_PLANES_OFFSET (STATE_HIRES_OFFSET + 1)
 
-static void clear_screen(Chip8* chip);
-static void execute(Chip8* chip, uint16_t opcode);
+// Operands Chip8Op does not store, they are parts of x and kk
+#define OP_NNN(op) ((uint16_t)((op)->x << 8 | (op)->kk))
+#define OP_N(op) ((op)->kk & 0x000F)
+
+// Last short backward jump seen by chip8_run and the registers when it ran.
+// Keys and timers are fixed for the whole call, so a loop that only reads
+// them and returns to the same registers repeats forever, one iteration is
+// enough to know the state at the end of the count.
+typedef struct {
+  int jump;
+  uint8_t registers[REGISTERS_SIZE];
+  uint16_t I;
+} WaitLoop;
+
+// Index of every handler in handlers[], what Chip8Op stores. Zero decodes,
+// so a cleared cache decodes everything.
+typedef enum {
+  HANDLER_DECODE,
+  HANDLER_UNKNOWN,
+  HANDLER_NOP,
+  HANDLER_CLS,
+  HANDLER_SCD,
+  HANDLER_SCU,
+  HANDLER_SCR,
+  HANDLER_SCL,
+  HANDLER_EXIT,
+  HANDLER_LOW,
+  HANDLER_HIGH,
+  HANDLER_RET,
+  HANDLER_JP,
+  HANDLER_CALL,
+  HANDLER_SE_BYTE,
+  HANDLER_SNE_BYTE,
+  HANDLER_SE_REG,
+  HANDLER_LD_RANGE,
+  HANDLER_LD_RANGE_I,
+  HANDLER_LD_BYTE,
+  HANDLER_ADD_BYTE,
+  HANDLER_LD_REG,
+  HANDLER_OR,
+  HANDLER_AND,
+  HANDLER_XOR,
+  HANDLER_OR_KEEP_VF,
+  HANDLER_AND_KEEP_VF,
+  HANDLER_XOR_KEEP_VF,
+  HANDLER_ADD_REG,
+  HANDLER_SUB,
+  HANDLER_SHR,
+  HANDLER_SHR_IN_PLACE,
+  HANDLER_SUBN,
+  HANDLER_SHL,
+  HANDLER_SHL_IN_PLACE,
+  HANDLER_SNE_REG,
+  HANDLER_LD_I,
+  HANDLER_JP_V0,
+  HANDLER_JP_VX,
+  HANDLER_RND,
+  HANDLER_DRW,
+  HANDLER_SKP,
+  HANDLER_SKNP,
+  HANDLER_LD_I_LONG,
+  HANDLER_PLANE,
+  HANDLER_AUDIO,
+  HANDLER_LD_VX_DT,
+  HANDLER_LD_VX_K,
+  HANDLER_LD_DT,
+  HANDLER_LD_ST,
+  HANDLER_ADD_I,
+  HANDLER_LD_F,
+  HANDLER_LD_HF,
+  HANDLER_LD_B,
+  HANDLER_LD_PITCH,
+  HANDLER_LD_I_VX,
+  HANDLER_LD_VX_I,
+  HANDLER_LD_I_VX_KEEP_I,
+  HANDLER_LD_VX_I_KEEP_I,
+  HANDLER_LD_R_VX,
+  HANDLER_LD_VX_R,
+  HANDLER_COUNT
+} Handler;
+
+static void clear_screen(Chip8* chip, uint8_t planes);
+static void skip_next_instruction(Chip8* chip);
+static uint8_t random_byte(Chip8* chip);
+static inline void execute(Chip8* chip, uint16_t pc);
+static uint16_t fetch(Chip8* chip, uint16_t address);
+static void decode(uint16_t opcode, uint8_t quirks, Chip8Op* op);
+static void store_byte(Chip8* chip, uint16_t address, uint8_t value);
+static int is_waiting(Chip8* chip, WaitLoop* loop, uint16_t pc, long* executed, long count)
+    __attribute__((noinline));
+static int is_wait_instruction(uint16_t opcode);
+static int is_pure_loop(Chip8* chip, uint16_t start, uint16_t end);
+static long verify_loop(Chip8* chip, uint16_t start, uint16_t end, long* executed, long count);
+static uint8_t* put_u16(uint8_t* p, uint16_t value);
+static uint8_t* put_u64(uint8_t* p, uint64_t value);
+static const uint8_t* get_u16(const uint8_t* p, uint16_t* value);
+static const uint8_t* get_u64(const uint8_t* p, uint64_t* value);
 static void instructions_draw_sprite(Chip8* chip, uint8_t x, uint8_t y, uint8_t n);
-static void instructions_compare(Chip8* chip, uint8_t x, uint8_t y, uint8_t n);
-static void instructions_f_branch(Chip8* chip, uint8_t x, uint8_t kk);
+static void scroll_rows(Chip8* chip, int n);
+static void scroll_columns(Chip8* chip, int n);
+static void set_resolution(Chip8* chip, uint8_t hires);
+static uint64_t row_mask(int height);
+static Handler decode_system(uint16_t opcode);
+static Handler decode_compare(uint8_t n, uint8_t quirks);
+static Handler decode_f_branch(uint8_t kk, uint8_t quirks);
+static void op_decode(Chip8* chip, const Chip8Op* op);
+static const Chip8Handler handlers[HANDLER_COUNT];
 
 
 void chip8_init(Chip8* chip) {
   assert(chip);
 
   // Zero out all memory
+  chip->quirks = 0;
+  chip->planes = 0x1;
+  chip->pitch = DEFAULT_PITCH;
   chip->SP = 0;
   chip->DT = 0;
   chip->ST = 0;
@@ -31,14 +143,20 @@ void chip8_init(Chip8* chip) {
   for (int i = 0; i < STACK_SIZE; i++) {
     chip->stack[i] = 0;
   }
+  for (int i = 0; i < REGISTERS_SIZE; i++) {
+    chip->flags[i] = 0;
+  }
+  for (int i = 0; i < PATTERN_SIZE; i++) {
+    chip->pattern[i] = 0;
+  }
   for (int i = 0; i < MEMORY_SIZE; i++) {
     chip->memory[i] = 0;
   }
-  for (int i = 0; i < KEYS_SIZE; i++) {
-    chip->keys[i] = 0;
-    chip->keys_memory[i] = 0;
-  }
-  clear_screen(chip);
+  chip->keys = 0;
+  chip->keys_memory = 0;
+  set_resolution(chip, 0);
+  chip8_invalidate(chip, 0, MEMORY_SIZE);
+  chip8_seed(chip, CHIP8_DEFAULT_SEED);
 
   // Load fonts into memory (0x000 to 0x1FF)
   uint8_t fonts[] = {
@@ -62,8 +180,39 @@ void chip8_init(Chip8* chip) {
   for (long unsigned int i = 0; i < sizeof(fonts); i++) {
     chip->memory[i] = fonts[i];
   }
-  // Seed random number
-  srand(time(NULL));
+
+  // SCHIP big digits, XO-CHIP adds A to F
+  uint8_t big_fonts[] = {
+      0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C,  // 0
+      0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C,  // 1
+      0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF,  // 2
+      0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C,  // 3
+      0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06,  // 4
+      0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C,  // 5
+      0x3E, 0x7C, 0xE0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C,  // 6
+      0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60,  // 7
+      0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C,  // 8
+      0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C,  // 9
+      0x3C, 0x7E, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3,  // A
+      0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC,  // B
+      0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C,  // C
+      0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC,  // D
+      0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xFF, 0xFF,  // E
+      0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xC0, 0xC0   // F
+  };
+  for (long unsigned int i = 0; i < sizeof(big_fonts); i++) {
+    chip->memory[BIG_FONT_ADDRESS + i] = big_fonts[i];
+  }
+}
+
+void chip8_seed(Chip8* chip, uint64_t seed) {
+  assert(chip);
+  // splitmix64 spreads similar seeds apart and never yields the zero state
+  uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z = z ^ (z >> 31);
+  chip->rng = z ? z : CHIP8_DEFAULT_SEED;
 }
 
 int chip8_load_file(Chip8* chip, const char* filename) {
@@ -82,16 +231,152 @@ int chip8_load_file(Chip8* chip, const char* filename) {
   file_size = ftell(fp);
   rewind(fp);
 
-  if (file_size >= MAX_PROGRAM_SIZE) {
+  if (file_size > MAX_PROGRAM_SIZE) {
     fclose(fp);
     return 2;
   }
   fread(buffer, file_size, 1, fp);
+  chip8_invalidate(chip, PROGRAM_START_ADDRESS, file_size);
 
   fclose(fp);
   return 0;
 }
 
+int chip8_load_rom(Chip8* chip, const uint8_t* rom, size_t size) {
+  assert(chip);
+  assert(rom || !size);
+
+  if (size > MAX_PROGRAM_SIZE) {
+    return 2;
+  }
+  memcpy(chip->memory + PROGRAM_START_ADDRESS, rom, size);
+  chip8_invalidate(chip, PROGRAM_START_ADDRESS, size);
+  return 0;
+}
+
+void chip8_set_quirks(Chip8* chip, uint8_t quirks) {
+  assert(chip);
+  // Handlers for the quirks are picked when decoding, everything decoded
+  // with the old ones is dropped
+  chip->quirks = quirks;
+  chip8_invalidate(chip, 0, MEMORY_SIZE);
+}
+
+void chip8_invalidate(Chip8* chip, uint16_t address, size_t length) {
+  // Drop decoded instructions overlapping the bytes, they are decoded again
+  // the next time they execute
+  assert(chip);
+  size_t start = (address > 0) ? address - 1 : 0;
+  size_t end = address + length;
+  if (end > DECODED_SIZE) {
+    end = DECODED_SIZE;
+  }
+  for (size_t i = start; i < end; i++) {
+    chip->decoded[i].handler = HANDLER_DECODE;
+  }
+}
+
+size_t chip8_save_state(const Chip8* chip, uint8_t* buffer, size_t size) {
+  // Returns the bytes written, 0 when the buffer is too small
+  assert(chip);
+  assert(buffer);
+  if (size < CHIP8_STATE_SIZE) {
+    return 0;
+  }
+
+  uint8_t* p = buffer;
+  memcpy(p, "C8ST", 4);
+  p += 4;
+  *p++ = CHIP8_STATE_VERSION;
+  memcpy(p, chip->registers, REGISTERS_SIZE);
+  p += REGISTERS_SIZE;
+  *p++ = chip->SP;
+  *p++ = chip->DT;
+  *p++ = chip->ST;
+  p = put_u16(p, chip->I);
+  p = put_u16(p, chip->PC);
+  for (int i = 0; i < STACK_SIZE; i++) {
+    p = put_u16(p, chip->stack[i]);
+  }
+  p = put_u64(p, chip->rng);
+  p = put_u16(p, chip->keys);
+  p = put_u16(p, chip->keys_memory);
+  memcpy(p, chip->flags, REGISTERS_SIZE);
+  p += REGISTERS_SIZE;
+  memcpy(p, chip->pattern, PATTERN_SIZE);
+  p += PATTERN_SIZE;
+  *p++ = chip->pitch;
+  *p++ = chip->hires;
+  *p++ = chip->planes;
+  const uint64_t* pixels = &chip->pixels[0][0][0];
+  for (int i = 0; i < PIXELS_SIZE; i++) {
+    p = put_u64(p, pixels[i]);
+  }
+  memcpy(p, chip->memory, MEMORY_SIZE);
+  p += MEMORY_SIZE;
+
+  assert(p - buffer == CHIP8_STATE_SIZE);
+  return CHIP8_STATE_SIZE;
+}
+
+int chip8_load_state(Chip8* chip, const uint8_t* buffer, size_t size) {
+  assert(chip);
+  assert(buffer);
+  if (size < CHIP8_STATE_SIZE) {
+    return 2;
+  }
+  if (memcmp(buffer, "C8ST", 4) || buffer[4] != CHIP8_STATE_VERSION) {
+    return 1;
+  }
+  // Values no machine can reach would index past the stack or the planes
+  if (buffer[STATE_SP_OFFSET] >= STACK_SIZE || buffer[STATE_HIRES_OFFSET] > 1
+      || buffer[STATE_PLANES_OFFSET] >> DISPLAY_PLANES) {
+    return 3;
+  }
+
+  const uint8_t* p = buffer + 5;
+  memcpy(chip->registers, p, REGISTERS_SIZE);
+  p += REGISTERS_SIZE;
+  chip->SP = *p++;
+  chip->DT = *p++;
+  chip->ST = *p++;
+  p = get_u16(p, &chip->I);
+  p = get_u16(p, &chip->PC);
+  for (int i = 0; i < STACK_SIZE; i++) {
+    p = get_u16(p, &chip->stack[i]);
+  }
+  p = get_u64(p, &chip->rng);
+  p = get_u16(p, &chip->keys);
+  p = get_u16(p, &chip->keys_memory);
+  memcpy(chip->flags, p, REGISTERS_SIZE);
+  p += REGISTERS_SIZE;
+  memcpy(chip->pattern, p, PATTERN_SIZE);
+  p += PATTERN_SIZE;
+  chip->pitch = *p++;
+  chip->hires = *p++;
+  chip->planes = *p++;
+  uint64_t* pixels = &chip->pixels[0][0][0];
+  for (int i = 0; i < PIXELS_SIZE; i++) {
+    p = get_u64(p, &pixels[i]);
+  }
+
+  // Only bytes that differ are written, so branching from the same
+  // checkpoint keeps the decoded instructions of untouched code
+  for (int i = 0; i < MEMORY_SIZE; i += 64) {
+    if (!memcmp(chip->memory + i, p + i, 64)) {
+      continue;
+    }
+    for (int j = i; j < i + 64; j++) {
+      if (chip->memory[j] != p[j]) {
+        store_byte(chip, j, p[j]);
+      }
+    }
+  }
+
+  chip->dirty_rows = row_mask(DISPLAY_HEGIHT);
+  return 0;
+}
+
 void chip8_timer_tick(Chip8* chip) {
   // Timers when non-zero, decremented at rate of 60Hz
   assert(chip);
@@ -99,300 +384,953 @@ void chip8_timer_tick(Chip8* chip) {
   if (chip->DT) {
     chip->DT = chip->DT - 1;
   }
+  // The buzzer is played by the audio engine from ST
   if (chip->ST) {
     chip->ST = chip->ST - 1;
-    if (chip->ST == 0) {
-      printf("\aBEEP!\n");
-    }
   }
 }
 
 void chip8_step(Chip8* chip) {
   assert(chip);
-  // Fetch
+  execute(chip, chip->PC);
+}
+
+int chip8_run(Chip8* chip, long count) {
+  assert(chip);
+  assert(count >= 0);
+
+  WaitLoop loop = {.jump = -1};
+  long executed = 0;
+  while (executed < count) {
+    uint16_t pc = chip->PC;
+    execute(chip, pc);
+    executed++;
+
+    // Only short backward jumps and instructions that stay in place can
+    // wait, everything else pays for a single compare
+    uint16_t back = pc - chip->PC;
+    if (__builtin_expect(back <= 2 * (CHIP8_WAIT_LOOP_SIZE - 1), 0)
+        && is_waiting(chip, &loop, pc, &executed, count)) {
+#ifdef CHIP8_PROFILE
+      // Profiles count the idle instructions too, they are what it looks for
+      for (; executed < count; executed++) {
+        execute(chip, chip->PC);
+      }
+#endif
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Static functions
+// ----------------------------------------------------------------------------
+
+static inline void execute(Chip8* chip, uint16_t pc) {
+  PROFILE_INSTRUCTION(pc, fetch(chip, pc));
+
+  // PC incremented to next instruction
+  chip->PC = pc + 2;
+
+  // Decoded instructions are cached per address, decoding only happens the
+  // first time an address executes or after its bytes are written
+  if (pc < DECODED_SIZE - 1) {
+    const Chip8Op* op = &chip->decoded[pc];
+    handlers[op->handler](chip, op);
+  } else {
+    Chip8Op op;
+    decode(fetch(chip, pc), chip->quirks, &op);
+    handlers[op.handler](chip, &op);
+  }
+}
+
+static uint16_t fetch(Chip8* chip, uint16_t address) {
   // instructions are stored big-endian
-  // Read memory at PC
   uint16_t opcode;
-  opcode = chip->memory[chip->PC]; // Upper byte
+  // addresses wrap around the 64KB address space
+  opcode = chip->memory[address & (MEMORY_SIZE - 1)]; // Upper byte
   opcode = opcode << 8;
-  opcode = opcode | chip->memory[chip->PC + 1]; // Lower byte
+  opcode = opcode | chip->memory[(address + 1) & (MEMORY_SIZE - 1)]; // Lower byte
+  return opcode;
+}
 
-  // PC incremented to next instruction
-  chip->PC = chip->PC + 2;
+static void store_byte(Chip8* chip, uint16_t address, uint8_t value) {
+  chip->memory[address] = value;
+  // Self-modifying code, the instructions covering this byte are stale
+  if (address < DECODED_SIZE) {
+    chip->decoded[address].handler = HANDLER_DECODE;
+  }
+  if (address > 0 && address <= DECODED_SIZE) {
+    chip->decoded[address - 1].handler = HANDLER_DECODE;
+  }
+}
 
-  // Decode and Execute
-  execute(chip, opcode);
+static int is_waiting(Chip8* chip, WaitLoop* loop, uint16_t pc, long* executed, long count) {
+  uint16_t opcode = fetch(chip, pc);
+  if (chip->PC == pc) {
+    // Fx0A still blocked, a jump to itself or 00FD
+    return is_wait_instruction(opcode);
+  }
+  if ((opcode & 0xF000) != 0x1000) {
+    return 0;
+  }
+
+  uint16_t start = chip->PC;
+  if (loop->jump == pc && chip->I == loop->I
+      && !memcmp(chip->registers, loop->registers, REGISTERS_SIZE)
+      && is_pure_loop(chip, start, pc)) {
+    long period = verify_loop(chip, start, pc, executed, count);
+    if (period) {
+#ifndef CHIP8_PROFILE
+      *executed += (count - *executed) / period * period;
+#endif
+      // The remainder is stepped normally, it stops mid loop
+      while (*executed < count) {
+        chip8_step(chip);
+        (*executed)++;
+      }
+      return 1;
+    }
+  }
+  loop->jump = pc;
+  memcpy(loop->registers, chip->registers, REGISTERS_SIZE);
+  loop->I = chip->I;
+  return 0;
+}
+
+static int is_wait_instruction(uint16_t opcode) {
+  // Instructions that, having returned to their own address once, do the
+  // same thing again until a key or timer changes
+  return (opcode & 0xF000) == 0x1000 || (opcode & 0xF000) == 0xB000
+         || (opcode & 0xF0FF) == 0xF00A || opcode == 0x00FD;
+}
+
+static int is_pure_loop(Chip8* chip, uint16_t start, uint16_t end) {
+  // Loop body from start up to the jump at end that only reads keys,
+  // timers and memory into registers and I
+  if ((end - start) & 0x1) {
+    return 0;
+  }
+  for (uint16_t address = start; address != end; address += 2) {
+    uint16_t opcode = fetch(chip, address);
+    uint8_t n = opcode & 0x000F;
+    uint8_t kk = opcode & 0x00FF;
+    switch (opcode >> 12) {
+      case 0x3: case 0x4: case 0x6: case 0x7: case 0xA:
+        break;
+      case 0x5:
+        if (n != 0x0 && n != 0x3) {
+          return 0;
+        }
+        break;
+      case 0x8:
+        if (n > 0x7 && n != 0xE) {
+          return 0;
+        }
+        break;
+      case 0x9:
+        if (n != 0x0) {
+          return 0;
+        }
+        break;
+      case 0xE:
+        if (kk != 0x9E && kk != 0xA1) {
+          return 0;
+        }
+        break;
+      case 0xF:
+        if (kk != 0x07 && kk != 0x1E && kk != 0x29 && kk != 0x30 && kk != 0x65 && kk != 0x85) {
+          return 0;
+        }
+        if (opcode == 0xF000) {
+          return 0;
+        }
+        break;
+      default:
+        return 0;
+    }
+  }
+  return 1;
+}
+
+static long verify_loop(Chip8* chip, uint16_t start, uint16_t end, long* executed, long count) {
+  // Steps one more iteration, returns its length when it stayed inside the
+  // loop and came back to the same registers, 0 otherwise
+  uint8_t registers[REGISTERS_SIZE];
+  memcpy(registers, chip->registers, REGISTERS_SIZE);
+  uint16_t I = chip->I;
+  long period = 0;
+  while (*executed < count) {
+    uint16_t pc = chip->PC;
+    chip8_step(chip);
+    (*executed)++;
+    period++;
+    if (pc == end) {
+      int same = chip->PC == start && chip->I == I && !memcmp(chip->registers, registers, REGISTERS_SIZE);
+      return same ? period : 0;
+    }
+    if (chip->PC < start || chip->PC > end) {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+static void skip_next_instruction(Chip8* chip) {
+  // F000 nnnn is the only instruction four bytes long
+  uint16_t pc = chip->PC;
+  int long_instruction = chip->memory[pc] == 0xF0 && chip->memory[(uint16_t)(pc + 1)] == 0x00;
+  chip->PC = pc + (long_instruction ? 4 : 2);
+}
+
+static uint8_t* put_u16(uint8_t* p, uint16_t value) {
+  // State blobs are little-endian
+  p[0] = value & 0xFF;
+  p[1] = value >> 8;
+  return p + 2;
+}
+
+static uint8_t* put_u64(uint8_t* p, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    p[i] = (value >> (8 * i)) & 0xFF;
+  }
+  return p + 8;
+}
+
+static const uint8_t* get_u16(const uint8_t* p, uint16_t* value) {
+  *value = (uint16_t)(p[0] | (p[1] << 8));
+  return p + 2;
+}
+
+static const uint8_t* get_u64(const uint8_t* p, uint64_t* value) {
+  *value = 0;
+  for (int i = 0; i < 8; i++) {
+    *value |= (uint64_t)p[i] << (8 * i);
+  }
+  return p + 8;
 }
 
 // ----------------------------------------------------------------------------
-// Static functions
+// Instruction handlers
 // ----------------------------------------------------------------------------
 
-static void execute(Chip8* chip, uint16_t opcode) {
+static uint8_t random_byte(Chip8* chip) {
+  // xorshift64*, the top bits have the best quality
+  uint64_t x = chip->rng;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  chip->rng = x;
+  return (uint8_t)((x * 0x2545F4914F6CDD1DULL) >> 56);
+}
+
+static void op_unknown(Chip8* chip, const Chip8Op* op) {
+  (void)chip;
+  (void)op;
+  printf("Unknown opcode.");
+}
+
+static void op_nop(Chip8* chip, const Chip8Op* op) {
+  (void)chip;
+  (void)op;
+}
+
+static void op_cls(Chip8* chip, const Chip8Op* op) {
   // 00E0 - CLS
-  if (opcode == 0x00E0) {
-    clear_screen(chip);
-    return;
-  }
+  (void)op;
+  clear_screen(chip, chip->planes);
+}
+
+static void op_scd(Chip8* chip, const Chip8Op* op) {
+  // 00Cn - SCD nibble
+  scroll_rows(chip, OP_N(op));
+}
+
+static void op_scu(Chip8* chip, const Chip8Op* op) {
+  // 00Dn - SCU nibble
+  scroll_rows(chip, -OP_N(op));
+}
+
+static void op_scr(Chip8* chip, const Chip8Op* op) {
+  // 00FB - SCR
+  (void)op;
+  scroll_columns(chip, SCROLL_PIXELS);
+}
+
+static void op_scl(Chip8* chip, const Chip8Op* op) {
+  // 00FC - SCL
+  (void)op;
+  scroll_columns(chip, -SCROLL_PIXELS);
+}
+
+static void op_exit(Chip8* chip, const Chip8Op* op) {
+  // 00FD - EXIT, the machine stays on this instruction
+  (void)op;
+  chip->PC -= 2;
+}
+
+static void op_low(Chip8* chip, const Chip8Op* op) {
+  // 00FE - LOW
+  (void)op;
+  set_resolution(chip, 0);
+}
+
+static void op_high(Chip8* chip, const Chip8Op* op) {
+  // 00FF - HIGH
+  (void)op;
+  set_resolution(chip, 1);
+}
+
+static void op_ret(Chip8* chip, const Chip8Op* op) {
   // 00EE - RET
-  if (opcode == 0x00EE) {
-    uint16_t sp = chip->SP;
-    assert(sp < STACK_SIZE);
-    chip->PC = chip->stack[sp];
-    chip->SP = sp - 1;
-    return;
+  (void)op;
+  uint16_t sp = chip->SP;
+  assert(sp < STACK_SIZE);
+  chip->PC = chip->stack[sp];
+  chip->SP = sp - 1;
+}
+
+static void op_jp(Chip8* chip, const Chip8Op* op) {
+  // 1nnn - JP addr
+  chip->PC = OP_NNN(op);
+}
+
+static void op_call(Chip8* chip, const Chip8Op* op) {
+  // 2nnn - CALL addr
+  chip->SP += 1;
+  chip->stack[chip->SP] = chip->PC;
+  chip->PC = OP_NNN(op);
+}
+
+static void op_se_byte(Chip8* chip, const Chip8Op* op) {
+  // 3xkk - SE Vx, byte
+  if (chip->registers[op->x] == op->kk) {
+    skip_next_instruction(chip);
+  }
+}
+
+static void op_sne_byte(Chip8* chip, const Chip8Op* op) {
+  // 4xkk - SNE Vx, byte
+  if (chip->registers[op->x] != op->kk) {
+    skip_next_instruction(chip);
+  }
+}
+
+static void op_se_reg(Chip8* chip, const Chip8Op* op) {
+  // 5xy0 - SE Vx, Vy
+  if (chip->registers[op->x] == chip->registers[op->y]) {
+    skip_next_instruction(chip);
+  }
+}
+
+static void op_ld_range(Chip8* chip, const Chip8Op* op) {
+  // 5xy2 - LD [I], Vx - Vy, I is left unchanged
+  int step = (op->x <= op->y) ? 1 : -1;
+  int count = (op->x <= op->y) ? op->y - op->x + 1 : op->x - op->y + 1;
+  for (int i = 0; i < count; i++) {
+    store_byte(chip, chip->I + i, chip->registers[op->x + i * step]);
+  }
+}
+
+static void op_ld_range_i(Chip8* chip, const Chip8Op* op) {
+  // 5xy3 - LD Vx - Vy, [I], I is left unchanged
+  int step = (op->x <= op->y) ? 1 : -1;
+  int count = (op->x <= op->y) ? op->y - op->x + 1 : op->x - op->y + 1;
+  for (int i = 0; i < count; i++) {
+    chip->registers[op->x + i * step] = chip->memory[(uint16_t)(chip->I + i)];
+  }
+}
+
+static void op_ld_byte(Chip8* chip, const Chip8Op* op) {
+  // 6xkk - LD Vx, byte
+  chip->registers[op->x] = op->kk;
+}
+
+static void op_add_byte(Chip8* chip, const Chip8Op* op) {
+  // 7xkk - ADD Vx, byte
+  chip->registers[op->x] = chip->registers[op->x] + op->kk;
+}
+
+static void op_ld_reg(Chip8* chip, const Chip8Op* op) {
+  // 8xy0 - LD Vx, Vy
+  chip->registers[op->x] = chip->registers[op->y];
+}
+
+static void op_add_reg(Chip8* chip, const Chip8Op* op) {
+  // 8xy4 - ADD Vx, Vy
+  uint16_t temp = (uint16_t)chip->registers[op->x] + chip->registers[op->y];
+  chip->registers[op->x] = (uint8_t)temp;
+  chip->registers[0xF] = (temp > 255) ? 1 : 0;
+}
+
+static void op_sub(Chip8* chip, const Chip8Op* op) {
+  // 8xy5 - SUB Vx, Vy
+  uint8_t temp = (chip->registers[op->x] >= chip->registers[op->y]) ? 1 : 0;
+  chip->registers[op->x] = chip->registers[op->x] - chip->registers[op->y];
+  chip->registers[0xF] = temp;
+}
+
+static void op_subn(Chip8* chip, const Chip8Op* op) {
+  // 8xy7 - SUBN Vx, Vy
+  uint8_t temp = (chip->registers[op->y] >= chip->registers[op->x]) ? 1 : 0;
+  chip->registers[op->x] = chip->registers[op->y] - chip->registers[op->x];
+  chip->registers[0xF] = temp;
+}
+
+static void op_sne_reg(Chip8* chip, const Chip8Op* op) {
+  // 9xy0 - SNE Vx, Vy
+  if (chip->registers[op->x] != chip->registers[op->y]) {
+    skip_next_instruction(chip);
+  }
+}
+
+static void op_ld_i(Chip8* chip, const Chip8Op* op) {
+  // Annn - LD I, addr
+  chip->I = OP_NNN(op);
+}
+
+static void op_rnd(Chip8* chip, const Chip8Op* op) {
+  // Cxkk - RND Vx, byte
+  chip->registers[op->x] = random_byte(chip) & op->kk;
+}
+
+static void op_drw(Chip8* chip, const Chip8Op* op) {
+  // Dxyn - DRW Vx, Vy, nibble
+  instructions_draw_sprite(chip, op->x, op->y, OP_N(op));
+}
+
+static void op_skp(Chip8* chip, const Chip8Op* op) {
+  // Ex9E - SKP Vx, only the low nibble of Vx selects the key
+  if ((chip->keys >> (chip->registers[op->x] & 0xF)) & 0x1) {
+    skip_next_instruction(chip);
+  }
+}
+
+static void op_sknp(Chip8* chip, const Chip8Op* op) {
+  // ExA1 - SKNP Vx
+  if (!((chip->keys >> (chip->registers[op->x] & 0xF)) & 0x1)) {
+    skip_next_instruction(chip);
+  }
+}
+
+static void op_ld_i_long(Chip8* chip, const Chip8Op* op) {
+  // F000 nnnn - LD I, long addr
+  (void)op;
+  chip->I = fetch(chip, chip->PC);
+  chip->PC += 2;
+}
+
+static void op_plane(Chip8* chip, const Chip8Op* op) {
+  // Fn01 - PLANE n
+  chip->planes = op->x & 0x3;
+}
+
+static void op_audio(Chip8* chip, const Chip8Op* op) {
+  // F002 - AUDIO, loads the pattern from [I]
+  (void)op;
+  for (int i = 0; i < PATTERN_SIZE; i++) {
+    chip->pattern[i] = chip->memory[(uint16_t)(chip->I + i)];
+  }
+}
+
+static void op_ld_vx_dt(Chip8* chip, const Chip8Op* op) {
+  // Fx07 - LD Vx, DT
+  chip->registers[op->x] = chip->DT;
+}
+
+static void op_ld_vx_k(Chip8* chip, const Chip8Op* op) {
+  // Fx0A - LD Vx, K, waits for a key to be pressed and released, the
+  // lowest one wins when several are released at once
+  uint16_t released = chip->keys_memory & ~chip->keys;
+  if (released) {
+    chip->registers[op->x] = __builtin_ctz(released);
+    chip->keys_memory = 0;
+  } else { // back up ie block until key press
+    chip->keys_memory |= chip->keys;
+    chip->PC -= 2;
+  }
+  PROFILE_KEY_WAIT(!released);
+}
+
+static void op_ld_dt(Chip8* chip, const Chip8Op* op) {
+  // Fx15 - LD DT, Vx
+  chip->DT = chip->registers[op->x];
+}
+
+static void op_ld_st(Chip8* chip, const Chip8Op* op) {
+  // Fx18 - LD ST, Vx
+  chip->ST = chip->registers[op->x];
+}
+
+static void op_add_i(Chip8* chip, const Chip8Op* op) {
+  // Fx1E - ADD I, Vx
+  chip->I = chip->I + chip->registers[op->x];
+}
+
+static void op_ld_f(Chip8* chip, const Chip8Op* op) {
+  // Fx29 - LD F, Vx
+  chip->I = 5 * chip->registers[op->x];
+}
+
+static void op_ld_hf(Chip8* chip, const Chip8Op* op) {
+  // Fx30 - LD HF, Vx
+  chip->I = BIG_FONT_ADDRESS + 10 * (chip->registers[op->x] & 0xF);
+}
+
+static void op_ld_pitch(Chip8* chip, const Chip8Op* op) {
+  // Fx3A - LD PITCH, Vx
+  chip->pitch = chip->registers[op->x];
+}
+
+static void op_ld_b(Chip8* chip, const Chip8Op* op) {
+  // Fx33 - LD B, Vx
+  uint8_t value = chip->registers[op->x];
+  store_byte(chip, chip->I, value / 100); // 100s
+  store_byte(chip, chip->I + 1, (value % 100) / 10); // 10s
+  store_byte(chip, chip->I + 2, value % 10); // 1s
+}
+
+static void op_ld_r_vx(Chip8* chip, const Chip8Op* op) {
+  // Fx75 - LD R, Vx
+  for (int i = 0; i <= op->x; i++) {
+    chip->flags[i] = chip->registers[i];
+  }
+}
+
+static void op_ld_vx_r(Chip8* chip, const Chip8Op* op) {
+  // Fx85 - LD Vx, R
+  for (int i = 0; i <= op->x; i++) {
+    chip->registers[i] = chip->flags[i];
+  }
+}
+
+static void op_decode(Chip8* chip, const Chip8Op* op) {
+  // Cache miss, decode the instruction in place then execute it
+  Chip8Op* entry = &chip->decoded[op - chip->decoded];
+  decode(fetch(chip, op - chip->decoded), chip->quirks, entry);
+  handlers[entry->handler](chip, entry);
+}
+
+// ----------------------------------------------------------------------------
+// Quirk variants
+// ----------------------------------------------------------------------------
+
+// Instructions that depend on a quirk get one handler per setting, decode
+// picks the one matching the quirks so executing them never tests a flag
+
+#define LOGIC_HANDLER(name, operator, keep_vf)                                      \
+  static void name(Chip8* chip, const Chip8Op* op) {                                \
+    chip->registers[op->x] = chip->registers[op->x] operator chip->registers[op->y]; \
+    if (!(keep_vf)) {                                                               \
+      chip->registers[0xF] = 0;                                                     \
+    }                                                                               \
+  }
+
+#define SHIFT_HANDLER(name, operator, out_bit, in_place)       \
+  static void name(Chip8* chip, const Chip8Op* op) {           \
+    uint8_t value = chip->registers[(in_place) ? op->x : op->y]; \
+    chip->registers[op->x] = value operator 1;                 \
+    chip->registers[0xF] = (value >> (out_bit)) & 0x1;         \
+  }
+
+#define JUMP_HANDLER(name, offset_register)                     \
+  static void name(Chip8* chip, const Chip8Op* op) {            \
+    chip->PC = chip->registers[offset_register] + OP_NNN(op);      \
   }
 
-  // Decode
+#define STORE_HANDLER(name, keep_i)                             \
+  static void name(Chip8* chip, const Chip8Op* op) {            \
+    for (int i = 0; i <= op->x; i++) {                          \
+      store_byte(chip, chip->I + i, chip->registers[i]);        \
+    }                                                           \
+    if (!(keep_i)) {                                            \
+      chip->I = chip->I + op->x + 1;                            \
+    }                                                           \
+  }
+
+#define LOAD_HANDLER(name, keep_i)                                           \
+  static void name(Chip8* chip, const Chip8Op* op) {                         \
+    for (int i = 0; i <= op->x; i++) {                                       \
+      chip->registers[i] = chip->memory[(uint16_t)(chip->I + i)];            \
+    }                                                                        \
+    if (!(keep_i)) {                                                         \
+      chip->I = chip->I + op->x + 1;                                         \
+    }                                                                        \
+  }
+
+// 8xy1 - OR Vx, Vy, 8xy2 - AND Vx, Vy, 8xy3 - XOR Vx, Vy
+LOGIC_HANDLER(op_or, |, 0)
+LOGIC_HANDLER(op_and, &, 0)
+LOGIC_HANDLER(op_xor, ^, 0)
+LOGIC_HANDLER(op_or_keep_vf, |, 1)
+LOGIC_HANDLER(op_and_keep_vf, &, 1)
+LOGIC_HANDLER(op_xor_keep_vf, ^, 1)
+
+// 8xy6 - SHR Vx {, Vy}, 8xyE - SHL Vx {, Vy}
+SHIFT_HANDLER(op_shr, >>, 0, 0)
+SHIFT_HANDLER(op_shl, <<, 7, 0)
+SHIFT_HANDLER(op_shr_in_place, >>, 0, 1)
+SHIFT_HANDLER(op_shl_in_place, <<, 7, 1)
+
+// Bnnn - JP V0, addr, Bxnn - JP Vx, addr with the jump quirk
+JUMP_HANDLER(op_jp_v0, 0)
+JUMP_HANDLER(op_jp_vx, op->x)
+
+// Fx55 - LD [I], Vx, Fx65 - LD Vx, [I]
+STORE_HANDLER(op_ld_i_vx, 0)
+LOAD_HANDLER(op_ld_vx_i, 0)
+STORE_HANDLER(op_ld_i_vx_keep_i, 1)
+LOAD_HANDLER(op_ld_vx_i_keep_i, 1)
+
+// Handlers by the index stored in Chip8Op
+static const Chip8Handler handlers[HANDLER_COUNT] = {
+  [HANDLER_DECODE] = op_decode,
+  [HANDLER_UNKNOWN] = op_unknown,
+  [HANDLER_NOP] = op_nop,
+  [HANDLER_CLS] = op_cls,
+  [HANDLER_SCD] = op_scd,
+  [HANDLER_SCU] = op_scu,
+  [HANDLER_SCR] = op_scr,
+  [HANDLER_SCL] = op_scl,
+  [HANDLER_EXIT] = op_exit,
+  [HANDLER_LOW] = op_low,
+  [HANDLER_HIGH] = op_high,
+  [HANDLER_RET] = op_ret,
+  [HANDLER_JP] = op_jp,
+  [HANDLER_CALL] = op_call,
+  [HANDLER_SE_BYTE] = op_se_byte,
+  [HANDLER_SNE_BYTE] = op_sne_byte,
+  [HANDLER_SE_REG] = op_se_reg,
+  [HANDLER_LD_RANGE] = op_ld_range,
+  [HANDLER_LD_RANGE_I] = op_ld_range_i,
+  [HANDLER_LD_BYTE] = op_ld_byte,
+  [HANDLER_ADD_BYTE] = op_add_byte,
+  [HANDLER_LD_REG] = op_ld_reg,
+  [HANDLER_OR] = op_or,
+  [HANDLER_AND] = op_and,
+  [HANDLER_XOR] = op_xor,
+  [HANDLER_OR_KEEP_VF] = op_or_keep_vf,
+  [HANDLER_AND_KEEP_VF] = op_and_keep_vf,
+  [HANDLER_XOR_KEEP_VF] = op_xor_keep_vf,
+  [HANDLER_ADD_REG] = op_add_reg,
+  [HANDLER_SUB] = op_sub,
+  [HANDLER_SHR] = op_shr,
+  [HANDLER_SHR_IN_PLACE] = op_shr_in_place,
+  [HANDLER_SUBN] = op_subn,
+  [HANDLER_SHL] = op_shl,
+  [HANDLER_SHL_IN_PLACE] = op_shl_in_place,
+  [HANDLER_SNE_REG] = op_sne_reg,
+  [HANDLER_LD_I] = op_ld_i,
+  [HANDLER_JP_V0] = op_jp_v0,
+  [HANDLER_JP_VX] = op_jp_vx,
+  [HANDLER_RND] = op_rnd,
+  [HANDLER_DRW] = op_drw,
+  [HANDLER_SKP] = op_skp,
+  [HANDLER_SKNP] = op_sknp,
+  [HANDLER_LD_I_LONG] = op_ld_i_long,
+  [HANDLER_PLANE] = op_plane,
+  [HANDLER_AUDIO] = op_audio,
+  [HANDLER_LD_VX_DT] = op_ld_vx_dt,
+  [HANDLER_LD_VX_K] = op_ld_vx_k,
+  [HANDLER_LD_DT] = op_ld_dt,
+  [HANDLER_LD_ST] = op_ld_st,
+  [HANDLER_ADD_I] = op_add_i,
+  [HANDLER_LD_F] = op_ld_f,
+  [HANDLER_LD_HF] = op_ld_hf,
+  [HANDLER_LD_B] = op_ld_b,
+  [HANDLER_LD_PITCH] = op_ld_pitch,
+  [HANDLER_LD_I_VX] = op_ld_i_vx,
+  [HANDLER_LD_VX_I] = op_ld_vx_i,
+  [HANDLER_LD_I_VX_KEEP_I] = op_ld_i_vx_keep_i,
+  [HANDLER_LD_VX_I_KEEP_I] = op_ld_vx_i_keep_i,
+  [HANDLER_LD_R_VX] = op_ld_r_vx,
+  [HANDLER_LD_VX_R] = op_ld_vx_r,
+};
+
+// ----------------------------------------------------------------------------
+// Decode
+// ----------------------------------------------------------------------------
+
+static void decode(uint16_t opcode, uint8_t quirks, Chip8Op* op) {
   // 0nnn 000n 0x00 00y0 00kk
-  uint8_t x = (uint8_t)((opcode & 0x0F00) >> 8);
-  uint8_t y = (uint8_t)((opcode & 0x00F0) >> 4);
-  uint8_t kk = (uint8_t)(opcode & 0x00FF);
-  uint8_t n = (uint8_t)(opcode & 0x000F);
-  uint16_t nnn = opcode & 0x0FFF;
+  op->x = (uint8_t)((opcode & 0x0F00) >> 8);
+  op->y = (uint8_t)((opcode & 0x00F0) >> 4);
+  op->kk = (uint8_t)(opcode & 0x00FF);
 
-  // Execute
   switch (opcode & 0xF000) {
+    case 0x0000:
+      op->handler = decode_system(opcode);
+      break;
     case 0x1000:
-      // 1nnn - JP addr
-      chip->PC = nnn;
+      op->handler = HANDLER_JP;
       break;
     case 0x2000:
-      // 2nnn - CALL addr
-      chip->SP += 1;
-      chip->stack[chip->SP] = chip->PC;
-      chip->PC = nnn;
+      op->handler = HANDLER_CALL;
       break;
     case 0x3000:
-      // 3xkk - SE Vx, byte
-      if (chip->registers[x] == kk) {
-        chip->PC += 2;
-      }
+      op->handler = HANDLER_SE_BYTE;
       break;
     case 0x4000:
-      // 4xkk - SNE Vx, byte
-      if (chip->registers[x] != kk) {
-        chip->PC += 2;
-      }
+      op->handler = HANDLER_SNE_BYTE;
       break;
     case 0x5000:
-      // 4xkk - SNE Vx, byte
-      if (chip->registers[x] == chip->registers[y]) {
-        chip->PC += 2;
+      if ((opcode & 0x000F) == 0x2) {
+        op->handler = HANDLER_LD_RANGE;
+      } else if ((opcode & 0x000F) == 0x3) {
+        op->handler = HANDLER_LD_RANGE_I;
+      } else {
+        op->handler = HANDLER_SE_REG;
       }
       break;
     case 0x6000:
-      // 6xkk - LD Vx, byte
-      chip->registers[x] = kk;
+      op->handler = HANDLER_LD_BYTE;
       break;
     case 0x7000:
-      // 7xkk - ADD Vx, byte
-      chip->registers[x] = chip->registers[x] + kk;
+      op->handler = HANDLER_ADD_BYTE;
       break;
     case 0x8000:
-      // Compare
-      instructions_compare(chip, x, y, n);
+      op->handler = decode_compare(opcode & 0x000F, quirks);
       break;
     case 0x9000:
-      // 9xy0 - SNE Vx, Vy
-      if (chip->registers[x] != chip->registers[y]) {
-        chip->PC += 2;
-      }
+      op->handler = HANDLER_SNE_REG;
       break;
     case 0xA000:
-      // Annn - LD I, addr
-      chip->I = nnn;
+      op->handler = HANDLER_LD_I;
       break;
     case 0xB000:
-      // Bnnn - JP V0, addr
-      chip->PC = chip->registers[0] + nnn;
+      op->handler = (quirks & CHIP8_QUIRK_JUMP) ? HANDLER_JP_VX : HANDLER_JP_V0;
       break;
     case 0xC000:
-      // Cxkk - RND Vx, byte
-      chip->registers[x] = (rand() % 256) & kk;
+      op->handler = HANDLER_RND;
       break;
     case 0xD000:
-      // Dxyn - DRW Vx, Vy, nibble
-      instructions_draw_sprite(chip, x, y, n);
+      op->handler = HANDLER_DRW;
       break;
     case 0xE000:
-      // Ex9E - SKP Vx
-      // ExA1 - SKNP Vx
-      if (kk == 0x9E) {
-        if (chip->keys[chip->registers[x]]) {
-          chip->PC += 2;
-        }
-      } else if (kk == 0xA1) {
-        if (!chip->keys[chip->registers[x]]) {
-          chip->PC += 2;
-        }
+      if (op->kk == 0x9E) {
+        op->handler = HANDLER_SKP;
+      } else if (op->kk == 0xA1) {
+        op->handler = HANDLER_SKNP;
+      } else {
+        op->handler = HANDLER_NOP;
       }
       break;
-    case 0xF000:
-      instructions_f_branch(chip, x, kk);
-      break;
     default:
-      printf("Unknown opcode.");
+      if (opcode == 0xF000) {
+        op->handler = HANDLER_LD_I_LONG;
+      } else if (opcode == 0xF002) {
+        op->handler = HANDLER_AUDIO;
+      } else {
+        op->handler = decode_f_branch(op->kk, quirks);
+      }
       break;
   }
 }
 
-static void instructions_f_branch(Chip8* chip, uint8_t x, uint8_t kk) {
-  uint8_t temp = 0;
+static Handler decode_system(uint16_t opcode) {
+  switch (opcode & 0xFFF0) {
+    case 0x00C0: return HANDLER_SCD;
+    case 0x00D0: return HANDLER_SCU;
+  }
+  switch (opcode) {
+    case 0x00E0: return HANDLER_CLS;
+    case 0x00EE: return HANDLER_RET;
+    case 0x00FB: return HANDLER_SCR;
+    case 0x00FC: return HANDLER_SCL;
+    case 0x00FD: return HANDLER_EXIT;
+    case 0x00FE: return HANDLER_LOW;
+    case 0x00FF: return HANDLER_HIGH;
+    default: return HANDLER_UNKNOWN;
+  }
+}
 
+static Handler decode_f_branch(uint8_t kk, uint8_t quirks) {
   switch (kk) {
-    case 0x07: // Fx07 - LD Vx, DT
-      chip->registers[x] = chip->DT;
-      break;
-    case 0x0A: // Fx0A - LD Vx, K
-      for (int i = 0; i < KEYS_SIZE; i++) {
-        if (chip->keys[i]) {
-          chip->keys_memory[i] = 1; // pressed
-        } else if (chip->keys_memory[i]) {
-          chip->registers[x] = i; // key released that was pressed
-          temp = 1;
-          // zero out memory
-          for (int j = 0; j < KEYS_SIZE; j++) {
-            chip->keys_memory[j] = 0;
-          }
-          break;
-        }
-      }
-      if (!temp) { // back up ie block until key press
-        chip->PC -= 2;
-      }
-      break;
-    case 0x15: // Fx15 - LD DT, Vx
-      chip->DT = chip->registers[x];
-      break;
-    case 0x18: // Fx18 - LD ST, Vx
-      chip->ST = chip->registers[x];
-      break;
-    case 0x1E: // Fx1E - ADD I, Vx
-      chip->I = chip->I + chip->registers[x];
-      break;
-    case 0x29: // Fx29 - LD F, Vx
-      chip->I = 5 * chip->registers[x];
-      break;
-    case 0x33: // Fx33 - LD B, Vx
-      chip->memory[chip->I] = chip->registers[x] / 100; // 100s
-      chip->memory[chip->I + 1] = (chip->registers[x] % 100) / 10; // 10s
-      chip->memory[chip->I + 2] = chip->registers[x] % 10;// 1s
-      break;
-    case 0x55: // Fx55 - LD [I], Vx
-      for (int i = 0; i <= x; i++) {
-        chip->memory[chip->I] = chip->registers[i];
-        chip->I = chip->I + 1;
-      }
-      break;
-    case 0x65: // Fx65 - LD Vx, [I]
-      for (int i = 0; i <= x; i++) {
-        chip->registers[i] = chip->memory[chip->I];
-        chip->I = chip->I + 1;
-      }
-      break;
-    default:
-      printf("Unknown opcode.");
-      break;
+    case 0x01: return HANDLER_PLANE;
+    case 0x07: return HANDLER_LD_VX_DT;
+    case 0x0A: return HANDLER_LD_VX_K;
+    case 0x15: return HANDLER_LD_DT;
+    case 0x18: return HANDLER_LD_ST;
+    case 0x1E: return HANDLER_ADD_I;
+    case 0x29: return HANDLER_LD_F;
+    case 0x30: return HANDLER_LD_HF;
+    case 0x33: return HANDLER_LD_B;
+    case 0x3A: return HANDLER_LD_PITCH;
+    case 0x55: return (quirks & CHIP8_QUIRK_KEEP_I) ? HANDLER_LD_I_VX_KEEP_I : HANDLER_LD_I_VX;
+    case 0x65: return (quirks & CHIP8_QUIRK_KEEP_I) ? HANDLER_LD_VX_I_KEEP_I : HANDLER_LD_VX_I;
+    case 0x75: return HANDLER_LD_R_VX;
+    case 0x85: return HANDLER_LD_VX_R;
+    default: return HANDLER_UNKNOWN;
   }
 }
 
-static void instructions_compare(Chip8* chip, uint8_t x, uint8_t y, uint8_t n) {
-  uint16_t temp = 0;
-
+static Handler decode_compare(uint8_t n, uint8_t quirks) {
   switch (n) {
-    case 0x00: // 8xy0 - LD Vx, Vy
-      chip->registers[x] = chip->registers[y];
-      break;
-    case 0x01: // 8xy1 - OR Vx, Vy
-      chip->registers[x] = chip->registers[x] | chip->registers[y];
-      chip->registers[0xF] = 0;
-      break;
-    case 0x02: // 8xy2 - AND Vx, Vy
-      chip->registers[x] = chip->registers[x] & chip->registers[y];
-      chip->registers[0xF] = 0;
-      break;
-    case 0x03: // 8xy3 - XOR Vx, Vy
-      chip->registers[x] = chip->registers[x] ^ chip->registers[y];
-      chip->registers[0xF] = 0;
-      break;
-    case 0x04: // 8xy4 - ADD Vx, Vy
-      temp = (uint16_t)chip->registers[x] + chip->registers[y];
-      chip->registers[x] = (uint8_t)temp;
-      chip->registers[0xF] = (temp > 255) ? 1 : 0;
-      break;
-    case 0x05: // 8xy5 - SUB Vx, Vy
-      temp = (chip->registers[x] >= chip->registers[y]) ? 1 : 0;
-      chip->registers[x] = chip->registers[x] - chip->registers[y];
-      chip->registers[0xF] = temp;
-      break;
-    case 0x06: // 8xy6 - SHR Vx {, Vy}
-      chip->registers[x] = chip->registers[y];
-      temp = chip->registers[x] & 0x1;
-      chip->registers[x] = chip->registers[x] >> 1;
-      chip->registers[0xF] = temp;
-      break;
-    case 0x07: // 8xy7 - SUBN Vx, Vy
-      temp = (chip->registers[y] >= chip->registers[x]) ? 1 : 0;
-      chip->registers[x] = chip->registers[y] - chip->registers[x];
-      chip->registers[0xF] = temp;
-      break;
-    case 0x0E: // 8xyE - SHL Vx {, Vy}
-      chip->registers[x] = chip->registers[y];
-      temp = (chip->registers[x] & 0x80) ? 1 : 0;
-      chip->registers[x] = chip->registers[x] << 1;
-      chip->registers[0xF] = temp;
-      break;
-    default:
-      printf("Unknown opcode.");
-      break;
+    case 0x00: return HANDLER_LD_REG;
+    case 0x01: return (quirks & CHIP8_QUIRK_KEEP_VF) ? HANDLER_OR_KEEP_VF : HANDLER_OR;
+    case 0x02: return (quirks & CHIP8_QUIRK_KEEP_VF) ? HANDLER_AND_KEEP_VF : HANDLER_AND;
+    case 0x03: return (quirks & CHIP8_QUIRK_KEEP_VF) ? HANDLER_XOR_KEEP_VF : HANDLER_XOR;
+    case 0x04: return HANDLER_ADD_REG;
+    case 0x05: return HANDLER_SUB;
+    case 0x06: return (quirks & CHIP8_QUIRK_SHIFT) ? HANDLER_SHR_IN_PLACE : HANDLER_SHR;
+    case 0x07: return HANDLER_SUBN;
+    case 0x0E: return (quirks & CHIP8_QUIRK_SHIFT) ? HANDLER_SHL_IN_PLACE : HANDLER_SHL;
+    default: return HANDLER_UNKNOWN;
   }
 }
 
 
 
 static void instructions_draw_sprite(Chip8* chip, uint8_t x, uint8_t y, uint8_t n) {
-  uint8_t sprite_row;
-  uint16_t sprite_address = chip->I;
-  uint8_t x_coord = chip->registers[x] % DISPLAY_WIDTH;
-  uint8_t y_coord = chip->registers[y] % DISPLAY_HEGIHT;
-  uint64_t bit = 0;
-  uint64_t mask = 0;
+  int width = chip->hires ? DISPLAY_WIDTH : LORES_WIDTH;
+  int height = chip->hires ? DISPLAY_HEGIHT : LORES_HEIGHT;
+  int words = width / 64;
+  int x_coord = chip->registers[x] % width;
+  int y_coord = chip->registers[y] % height;
+  int wrap = chip->quirks & CHIP8_QUIRK_WRAP;
+  // Dxy0 draws a 16x16 sprite
+  int rows = n ? n : 16;
+  int sprite_width = n ? SPRITE_WIDTH : 2 * SPRITE_WIDTH;
+  int row_bytes = sprite_width / 8;
 
-  chip->registers[0xF] = 0;
+  // The sprite covers at most two words of a row, the second one gets the
+  // bits shifted past the end of the first
+  int word = x_coord / 64;
+  int shift = x_coord % 64;
+  int next = word + 1;
+  if (next == words) {
+    next = wrap ? 0 : -1;
+  }
+  if (!shift) {
+    next = -1;
+  }
 
-  for (int i = 0; i < n; i++) {
-    if (y_coord + i >= DISPLAY_HEGIHT) {
-      break;
+  // Every selected plane has its own sprite data, one after the other
+  uint16_t sprite_address = chip->I;
+  uint64_t collision = 0;
+  uint64_t dirty = 0; // rows the sprite has pixels in
+#ifdef CHIP8_PROFILE
+  int touched = 0;
+#endif
+  for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+    if (!(chip->planes & (1 << plane))) {
+      continue;
     }
-    sprite_row = chip->memory[sprite_address + i];
-    for (int j = 0; j < SPRITE_WIDTH; j++) {
-      if (x_coord + j >= DISPLAY_WIDTH) {
-        break;
+
+    // A row of pixels is a word or two, every sprite row is drawn with one
+    // shift, one AND for the collision and one XOR per word
+    for (int i = 0; i < rows; i++) {
+      int row = y_coord + i;
+      if (row >= height) {
+        if (!wrap) {
+          break;
+        }
+        row -= height;
       }
-      bit = sprite_row >> (SPRITE_WIDTH - 1 - j);
-      bit = bit & 0x1;
-      bit = bit << (63 - (x_coord + j));
-      mask = 0x1UL << (63 - (x_coord + j));
-
-      // if both bit and pixel are set then set VF
-      if (bit && (mask & chip->pixels[y_coord + i]) && !chip->registers[0xF]) {
-        chip->registers[0xF] = 1;
+      uint16_t address = sprite_address + i * row_bytes;
+      uint64_t sprite_row = chip->memory[address];
+      if (row_bytes == 2) {
+        sprite_row = (sprite_row << 8) | chip->memory[(uint16_t)(address + 1)];
       }
-      // xor in the bit
-      chip->pixels[y_coord + i] = chip->pixels[y_coord + i] ^ bit;
+      sprite_row = sprite_row << (64 - sprite_width);
+
+      uint64_t* pixels = chip->pixels[plane][row];
+      uint64_t bits = sprite_row >> shift;
+      collision = collision | (pixels[word] & bits);
+      pixels[word] = pixels[word] ^ bits;
+      dirty = dirty | ((uint64_t)(sprite_row != 0) << row);
+#ifdef CHIP8_PROFILE
+      touched += __builtin_popcountll(bits);
+#endif
+      // Bits past the right edge are clipped unless they wrap around
+      if (next >= 0) {
+        bits = sprite_row << (64 - shift);
+        collision = collision | (pixels[next] & bits);
+        pixels[next] = pixels[next] ^ bits;
+#ifdef CHIP8_PROFILE
+        touched += __builtin_popcountll(bits);
+#endif
+      }
+    }
+    sprite_address += rows * row_bytes;
+  }
+
+  PROFILE_DRAW(touched);
+  chip->registers[0xF] = collision ? 1 : 0;
+  chip->dirty_rows = chip->dirty_rows | dirty;
+}
+
+static void scroll_rows(Chip8* chip, int n) {
+  // Down when n is positive, up when negative, rows are whole words so the
+  // scroll is a block move
+  int height = chip->hires ? DISPLAY_HEGIHT : LORES_HEIGHT;
+  int count = (n < 0) ? -n : n;
+  if (count > height) {
+    count = height;
+  }
+  size_t row_size = sizeof(chip->pixels[0][0]);
+  for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+    if (!(chip->planes & (1 << plane))) {
+      continue;
+    }
+    uint64_t (*rows)[ROW_WORDS] = chip->pixels[plane];
+    if (n > 0) {
+      memmove(rows[count], rows[0], (height - count) * row_size);
+      memset(rows[0], 0, count * row_size);
+    } else {
+      memmove(rows[0], rows[count], (height - count) * row_size);
+      memset(rows[height - count], 0, count * row_size);
     }
   }
+  chip->dirty_rows = chip->dirty_rows | row_mask(height);
+}
 
-  chip->draw_flag = 1;
+static void scroll_columns(Chip8* chip, int n) {
+  // Right when n is positive, left when negative, |n| < 64
+  int height = chip->hires ? DISPLAY_HEGIHT : LORES_HEIGHT;
+  int words = chip->hires ? ROW_WORDS : 1;
+  for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+    if (!(chip->planes & (1 << plane))) {
+      continue;
+    }
+    for (int row = 0; row < height; row++) {
+      uint64_t* pixels = chip->pixels[plane][row];
+      if (n > 0) {
+        for (int i = words - 1; i >= 0; i--) {
+          uint64_t carry = (i > 0) ? pixels[i - 1] << (64 - n) : 0;
+          pixels[i] = (pixels[i] >> n) | carry;
+        }
+      } else {
+        for (int i = 0; i < words; i++) {
+          uint64_t carry = (i + 1 < words) ? pixels[i + 1] >> (64 + n) : 0;
+          pixels[i] = (pixels[i] << -n) | carry;
+        }
+      }
+    }
+  }
+  chip->dirty_rows = chip->dirty_rows | row_mask(height);
 }
 
+static void set_resolution(Chip8* chip, uint8_t hires) {
+  // Switching clears every plane, pixels outside the lores area stay blank
+  chip->hires = hires;
+  memset(chip->pixels, 0, sizeof(chip->pixels));
+  chip->dirty_rows = row_mask(DISPLAY_HEGIHT);
+}
 
+static uint64_t row_mask(int height) {
+  // Bits of the first height rows of dirty_rows
+  return (height >= 64) ? ~0ULL : (1ULL << height) - 1;
+}
 
-static void clear_screen(Chip8* chip) {
+static void clear_screen(Chip8* chip, uint8_t planes) {
   assert(chip);
-  for (int i = 0; i < PIXELS_SIZE; i++) {
-    chip->pixels[i] = 0UL;
+  int height = chip->hires ? DISPLAY_HEGIHT : LORES_HEIGHT;
+  for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+    if (planes & (1 << plane)) {
+      memset(chip->pixels[plane], 0, height * sizeof(chip->pixels[plane][0]));
+    }
   }
-  chip->draw_flag = 1;
+  chip->dirty_rows = chip->dirty_rows | row_mask(height);
 }
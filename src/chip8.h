@@ -1,35 +1,101 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define REGISTERS_SIZE 16
 #define STACK_SIZE 16
-#define PIXELS_SIZE 32
-#define MEMORY_SIZE 4095
+#define MEMORY_SIZE 65536 // XO-CHIP address space
+#define PROGRAM_START_ADDRESS 0x200 // where ROMs are loaded and run from
+#define DECODED_SIZE 4096 // addresses reachable by jumps, the only ones decoded ahead
 #define KEYS_SIZE 16
+#define PATTERN_SIZE 16 // XO-CHIP audio pattern, 128 one bit samples
 
-#define DISPLAY_WIDTH 64
-#define DISPLAY_HEGIHT 32
+#define CHIP8_DEFAULT_SEED 0x8BADF00DULL
+#define CHIP8_DEFAULT_IPF 15 // instructions per 60Hz frame
+#define CHIP8_WAIT_LOOP_SIZE 8 // longest loop, in instructions, chip8_run checks for waits
 
-typedef struct {
-  uint8_t draw_flag; // Whether pixels have been changed
-  uint8_t keys[KEYS_SIZE]; // Keyboard state
-  uint8_t keys_memory[KEYS_SIZE]; // Keyboard state history, used for opcode Fx0A
+// Save state blob: magic, version, then every field of the machine state
+#define CHIP8_STATE_VERSION 3
+#define CHIP8_STATE_SIZE (4 + 1 + REGISTERS_SIZE + 3 + 2 + 2 + 2 * STACK_SIZE + 8 \
+                          + 2 + 2 + REGISTERS_SIZE + PATTERN_SIZE + 3 \
+                          + 8 * PIXELS_SIZE + MEMORY_SIZE)
+
+// Behaviours that differ between CHIP-8 interpreters, set with chip8_set_quirks
+#define CHIP8_QUIRK_WRAP 0x01 // sprites wrap around the display edges instead of clipping
+#define CHIP8_QUIRK_SHIFT 0x02 // 8xy6 and 8xyE shift Vx in place instead of copying Vy
+#define CHIP8_QUIRK_KEEP_VF 0x04 // 8xy1, 8xy2 and 8xy3 leave VF alone instead of clearing it
+#define CHIP8_QUIRK_KEEP_I 0x08 // Fx55 and Fx65 leave I unchanged instead of advancing it
+#define CHIP8_QUIRK_JUMP 0x10 // Bxnn jumps to xnn + Vx instead of nnn + V0
+
+// Framebuffer sized for SCHIP hires mode, lores mode only uses the first
+// word of the first LORES_HEIGHT rows. Bit 63 of a word is its leftmost pixel.
+// DISPLAY_HEGIHT can not exceed 64, every row has a bit in Chip8.dirty_rows.
+#define DISPLAY_WIDTH 128
+#define DISPLAY_HEGIHT 64
+#define LORES_WIDTH 64
+#define LORES_HEIGHT 32
+#define DISPLAY_PLANES 2 // XO-CHIP bitplanes
+#define ROW_WORDS (DISPLAY_WIDTH / 64)
+#define PIXELS_SIZE (DISPLAY_PLANES * DISPLAY_HEGIHT * ROW_WORDS)
+
+typedef struct Chip8 Chip8;
+typedef struct Chip8Op Chip8Op;
+typedef void (*Chip8Handler)(Chip8* chip, const Chip8Op* op);
+
+// Predecoded instruction, operands are extracted once per address. Four
+// bytes keep the cache of thousands of instances small, nnn and n are
+// recovered from x and kk.
+struct Chip8Op {
+  uint8_t handler; // index of the handler, 0 decodes the instruction first
+  uint8_t x;
+  uint8_t y;
+  uint8_t kk;
+};
+
+struct Chip8 {
+  uint64_t dirty_rows; // bit y set when display row y may have changed, cleared by the presenter
+  uint8_t quirks; // CHIP8_QUIRK_* flags, configuration rather than machine state, read only
+  uint16_t keys; // Keyboard state, bit i set while key i is held
+  uint16_t keys_memory; // Keys pressed while Fx0A waits
   uint8_t registers[REGISTERS_SIZE]; // 16 general purpose 8-bit registers
   uint8_t SP; // stack pointer, top of stack
   uint8_t DT; // Delay timer
   uint8_t ST; // Sound timer, buzz sound when non-zero
-  uint16_t I; // 16-bit register stores memory addresses (only lower 12 bits are used)
+  uint16_t I; // 16-bit register stores memory addresses
   uint16_t PC; // program counter, current executing address
   uint16_t stack[STACK_SIZE]; // return addresses
-  uint64_t pixels[PIXELS_SIZE]; // Display
+  uint64_t rng; // xorshift64* state used by Cxkk, never zero
+  uint8_t flags[REGISTERS_SIZE]; // SCHIP user flags, Fx75 and Fx85
+  uint8_t pattern[PATTERN_SIZE]; // XO-CHIP audio pattern, loaded by F002
+  uint8_t pitch; // XO-CHIP playback rate of the pattern, Fx3A
+  uint8_t hires; // 1 in 128x64 mode, 0 in 64x32 mode
+  uint8_t planes; // bitplanes drawn, cleared and scrolled, Fn01
+  uint64_t pixels[DISPLAY_PLANES][DISPLAY_HEGIHT][ROW_WORDS]; // Display
   uint8_t memory[MEMORY_SIZE];  // RAM
-} Chip8;
+  Chip8Op decoded[DECODED_SIZE]; // Decoded instruction starting at each address
+};
 
 void chip8_init(Chip8* chip);
+void chip8_seed(Chip8* chip, uint64_t seed);
 void chip8_timer_tick(Chip8* chip);
 void chip8_step(Chip8* chip);
+// Same result as count calls to chip8_step, but a machine waiting on Fx0A
+// or spinning in a loop that can not change before the next timer tick or
+// key event skips the rest of the count. Returns 1 when it ended waiting.
+int chip8_run(Chip8* chip, long count);
+// Selects the handlers for the quirks once, instead of testing them on every
+// instruction. A JIT running the chip must be flushed afterwards.
+void chip8_set_quirks(Chip8* chip, uint8_t quirks);
 int chip8_load_file(Chip8* chip, const char* filename);
+// Copies a ROM image already in memory to the program start
+int chip8_load_rom(Chip8* chip, const uint8_t* rom, size_t size);
+void chip8_invalidate(Chip8* chip, uint16_t address, size_t length);
+size_t chip8_save_state(const Chip8* chip, uint8_t* buffer, size_t size);
+// Returns 1 for another format or version, 2 when buffer is too small and
+// 3 for a stack pointer, resolution or plane mask out of range. chip is
+// left untouched on failure.
+int chip8_load_state(Chip8* chip, const uint8_t* buffer, size_t size);
 
 #endif
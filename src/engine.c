@@ -0,0 +1,266 @@
+#define _POSIX_C_SOURCE 200809L // Needed for pthread barriers and sysconf
+
+#include "engine.h"
+#include "chip8.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE 8 // instances claimed from a range at once
+#define CACHE_LINE 64
+
+typedef struct {
+  long ipf; // instructions per frame
+  long frames; // frames left, negative runs forever
+} Budget;
+
+// Instances handed to one worker each tick. The owner claims chunks from the
+// front, once its own range is drained it claims chunks from the others.
+typedef struct {
+  long next; // next instance to claim, shared by every worker
+  long begin;
+  long end; // one past the last instance
+  char padding[CACHE_LINE - 3 * sizeof(long)]; // keep ranges on separate cache lines
+} Range;
+
+typedef struct {
+  Chip8Engine* engine;
+  int id;
+} Worker;
+
+struct Chip8Engine {
+  Chip8* chips;
+  Budget* budgets;
+  int count;
+  int thread_count; // workers including the thread calling chip8_engine_run
+  Range* ranges;
+  Worker* workers;
+  pthread_t* threads;
+  pthread_barrier_t start; // released when a tick begins
+  pthread_barrier_t finish; // released when every worker finished the tick
+  pthread_mutex_t starting; // held while the workers are created
+  int quit;
+  int running; // instances with budget left after the tick
+  Chip8EngineDone done; // NULL when not set
+  void* done_context;
+};
+
+static void* worker_main(void* arg);
+static void run_tick(Chip8Engine* engine, int id);
+static int run_instance(Chip8Engine* engine, long index);
+static void free_engine(Chip8Engine* engine);
+
+
+Chip8Engine* chip8_engine_create(int instance_count, int thread_count) {
+  assert(instance_count > 0);
+
+  if (thread_count <= 0) {
+    thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (thread_count <= 0) {
+      thread_count = 1;
+    }
+  }
+  if (thread_count > instance_count) {
+    thread_count = instance_count;
+  }
+
+  Chip8Engine* engine = calloc(1, sizeof(Chip8Engine));
+  if (!engine) {
+    return NULL;
+  }
+  engine->count = instance_count;
+  engine->thread_count = thread_count;
+  engine->chips = malloc(instance_count * sizeof(Chip8));
+  engine->budgets = calloc(instance_count, sizeof(Budget));
+  engine->ranges = calloc(thread_count, sizeof(Range));
+  engine->workers = calloc(thread_count, sizeof(Worker));
+  engine->threads = calloc(thread_count, sizeof(pthread_t));
+  if (!engine->chips || !engine->budgets || !engine->ranges || !engine->workers || !engine->threads) {
+    free_engine(engine);
+    return NULL;
+  }
+
+  for (int i = 0; i < instance_count; i++) {
+    chip8_init(&engine->chips[i]);
+  }
+  for (int i = 0; i < thread_count; i++) {
+    engine->ranges[i].begin = (long)instance_count * i / thread_count;
+    engine->ranges[i].end = (long)instance_count * (i + 1) / thread_count;
+    engine->workers[i].engine = engine;
+    engine->workers[i].id = i;
+  }
+
+  if (pthread_barrier_init(&engine->start, NULL, thread_count)) {
+    free_engine(engine);
+    return NULL;
+  }
+  if (pthread_barrier_init(&engine->finish, NULL, thread_count)) {
+    pthread_barrier_destroy(&engine->start);
+    free_engine(engine);
+    return NULL;
+  }
+  pthread_mutex_init(&engine->starting, NULL);
+
+  // Worker 0 is whoever calls chip8_engine_run. The others wait for the
+  // lock before the barriers, which can not release them with a worker
+  // missing.
+  pthread_mutex_lock(&engine->starting);
+  int started = 1;
+  while (started < thread_count
+         && !pthread_create(&engine->threads[started], NULL, worker_main, &engine->workers[started])) {
+    started++;
+  }
+  engine->quit = started < thread_count;
+  pthread_mutex_unlock(&engine->starting);
+  if (engine->quit) {
+    for (int i = 1; i < started; i++) {
+      pthread_join(engine->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&engine->starting);
+    pthread_barrier_destroy(&engine->start);
+    pthread_barrier_destroy(&engine->finish);
+    free_engine(engine);
+    return NULL;
+  }
+  return engine;
+}
+
+void chip8_engine_destroy(Chip8Engine* engine) {
+  if (!engine) {
+    return;
+  }
+  engine->quit = 1;
+  pthread_barrier_wait(&engine->start);
+  for (int i = 1; i < engine->thread_count; i++) {
+    pthread_join(engine->threads[i], NULL);
+  }
+  pthread_mutex_destroy(&engine->starting);
+  pthread_barrier_destroy(&engine->start);
+  pthread_barrier_destroy(&engine->finish);
+  free_engine(engine);
+}
+
+int chip8_engine_count(Chip8Engine* engine) {
+  assert(engine);
+  return engine->count;
+}
+
+Chip8* chip8_engine_instance(Chip8Engine* engine, int index) {
+  assert(engine);
+  assert(index >= 0 && index < engine->count);
+  return &engine->chips[index];
+}
+
+void chip8_engine_set_budget(Chip8Engine* engine, int index, long ipf, long frames) {
+  assert(engine);
+  assert(index >= 0 && index < engine->count);
+  engine->budgets[index].ipf = ipf;
+  engine->budgets[index].frames = frames;
+}
+
+void chip8_engine_set_done(Chip8Engine* engine, Chip8EngineDone done, void* context) {
+  assert(engine);
+  engine->done = done;
+  engine->done_context = context;
+}
+
+int chip8_engine_run(Chip8Engine* engine, long ticks) {
+  assert(engine);
+
+  int running = 0;
+  for (int i = 0; i < engine->count; i++) {
+    running += (engine->budgets[i].frames != 0);
+  }
+
+  for (long tick = 0; tick < ticks && running; tick++) {
+    for (int i = 0; i < engine->thread_count; i++) {
+      engine->ranges[i].next = engine->ranges[i].begin;
+    }
+    engine->running = 0;
+
+    pthread_barrier_wait(&engine->start);
+    run_tick(engine, 0);
+    pthread_barrier_wait(&engine->finish);
+
+    running = engine->running;
+  }
+  return running;
+}
+
+// ----------------------------------------------------------------------------
+// Static functions
+// ----------------------------------------------------------------------------
+
+static void* worker_main(void* arg) {
+  Worker* worker = arg;
+  Chip8Engine* engine = worker->engine;
+
+  pthread_mutex_lock(&engine->starting);
+  int quit = engine->quit; // another worker failed to start
+  pthread_mutex_unlock(&engine->starting);
+  if (quit) {
+    return NULL;
+  }
+
+  for (;;) {
+    // The barrier also publishes the ranges reset by chip8_engine_run
+    pthread_barrier_wait(&engine->start);
+    if (engine->quit) {
+      break;
+    }
+    run_tick(engine, worker->id);
+    pthread_barrier_wait(&engine->finish);
+  }
+  return NULL;
+}
+
+static void run_tick(Chip8Engine* engine, int id) {
+  int running = 0;
+
+  // Own range first, then steal from the other workers
+  for (int i = 0; i < engine->thread_count; i++) {
+    Range* range = &engine->ranges[(id + i) % engine->thread_count];
+    long start;
+    while ((start = __atomic_fetch_add(&range->next, CHUNK_SIZE, __ATOMIC_RELAXED)) < range->end) {
+      long end = start + CHUNK_SIZE;
+      if (end > range->end) {
+        end = range->end;
+      }
+      for (long j = start; j < end; j++) {
+        running += run_instance(engine, j);
+      }
+    }
+  }
+
+  __atomic_fetch_add(&engine->running, running, __ATOMIC_RELAXED);
+}
+
+static int run_instance(Chip8Engine* engine, long index) {
+  Budget* budget = &engine->budgets[index];
+  if (budget->frames == 0) {
+    return 0;
+  }
+
+  Chip8* chip = &engine->chips[index];
+  chip8_run(chip, budget->ipf);
+  chip8_timer_tick(chip);
+
+  if (budget->frames > 0) {
+    budget->frames--;
+    if (budget->frames == 0 && engine->done) {
+      engine->done(engine->done_context, index, chip);
+    }
+  }
+  return budget->frames != 0;
+}
+
+static void free_engine(Chip8Engine* engine) {
+  free(engine->chips);
+  free(engine->budgets);
+  free(engine->ranges);
+  free(engine->workers);
+  free(engine->threads);
+  free(engine);
+}
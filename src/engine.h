@@ -0,0 +1,27 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "chip8.h"
+
+// Steps many independent Chip8 instances in parallel on a pool of worker
+// threads. Every 60Hz tick each running instance executes its instructions
+// per frame followed by a timer tick, all threads meet at a barrier before
+// the next tick starts.
+typedef struct Chip8Engine Chip8Engine;
+
+// thread_count <= 0 uses one thread per online CPU, returns NULL on failure
+Chip8Engine* chip8_engine_create(int instance_count, int thread_count);
+void chip8_engine_destroy(Chip8Engine* engine);
+
+int chip8_engine_count(Chip8Engine* engine);
+Chip8* chip8_engine_instance(Chip8Engine* engine, int index);
+// frames < 0 runs the instance until the engine stops, 0 pauses it
+void chip8_engine_set_budget(Chip8Engine* engine, int index, long ipf, long frames);
+// Runs up to ticks frames, returns the number of instances with budget left
+int chip8_engine_run(Chip8Engine* engine, long ticks);
+// Called on the worker thread that ran the last frame of an instance's
+// budget, right after its timer tick
+typedef void (*Chip8EngineDone)(void* context, int index, Chip8* chip);
+void chip8_engine_set_done(Chip8Engine* engine, Chip8EngineDone done, void* context);
+
+#endif
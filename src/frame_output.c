@@ -0,0 +1,267 @@
+#define _POSIX_C_SOURCE 200809L // Needed for fdopen and dup
+
+#include "frame_output.h"
+#include "chip8.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define QUEUE_SIZE 64 // frames the emulation can run ahead of the writer
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+#define Y4M_PLANE_SIZE (DISPLAY_WIDTH * DISPLAY_HEGIHT)
+#define PBM_FRAME_SIZE (DISPLAY_WIDTH / 8 * DISPLAY_HEGIHT)
+
+typedef struct {
+  uint64_t pixels[DISPLAY_PLANES][DISPLAY_HEGIHT][ROW_WORDS];
+  uint8_t hires;
+} QueuedFrame;
+
+struct FrameOutput {
+  FILE* fp;
+  FrameFormat format;
+  int changed_only;
+  long count; // frames queued, owned by the caller
+  QueuedFrame last; // last frame queued, owned by the caller
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t queued; // signaled when a frame was queued or the output closes
+  pthread_cond_t written; // signaled when a slot was freed
+  QueuedFrame queue[QUEUE_SIZE];
+  int head; // oldest queued frame, owned by the writer
+  int used; // guarded by lock
+  int closing; // guarded by lock
+  int failed; // a write came up short, owned by the writer
+
+  char* buffer; // stdio buffer
+  uint8_t converted[3 * Y4M_PLANE_SIZE];
+  // Y4M bytes of four pixels per channel, indexed by four bits of the first
+  // plane with the same four bits of the second plane above them
+  uint8_t quads[3][256][4];
+  uint8_t doubled[3][256][8]; // the same for lores, every pixel twice
+};
+
+static void* writer_main(void* arg);
+static void fill_y4m_tables(FrameOutput* output);
+static size_t convert_y4m(const FrameOutput* output, const QueuedFrame* frame, uint8_t* out);
+static size_t convert_pbm(const QueuedFrame* frame, uint8_t* out);
+
+
+FrameOutput* frame_output_open(const char* filename, FrameFormat format, int changed_only) {
+  assert(filename);
+
+  FrameOutput* output = calloc(1, sizeof(FrameOutput));
+  if (!output) {
+    return NULL;
+  }
+  output->buffer = malloc(WRITE_BUFFER_SIZE);
+  if (!output->buffer) {
+    free(output);
+    return NULL;
+  }
+  if (strcmp(filename, "-")) {
+    output->fp = fopen(filename, "wb");
+  } else {
+    // The stream takes over stdout, whatever else is printed goes to stderr
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    if (fd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) >= 0) {
+      output->fp = fdopen(fd, "wb");
+    }
+  }
+  if (!output->fp) {
+    free(output->buffer);
+    free(output);
+    return NULL;
+  }
+  setvbuf(output->fp, output->buffer, _IOFBF, WRITE_BUFFER_SIZE);
+  output->format = format;
+  output->changed_only = changed_only;
+
+  // Y4M has a single header for the stream, PBM one per frame
+  if (format == FRAME_FORMAT_Y4M) {
+    fill_y4m_tables(output);
+    fprintf(output->fp, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C444\n", DISPLAY_WIDTH, DISPLAY_HEGIHT);
+  }
+
+  pthread_mutex_init(&output->lock, NULL);
+  pthread_cond_init(&output->queued, NULL);
+  pthread_cond_init(&output->written, NULL);
+  if (pthread_create(&output->thread, NULL, writer_main, output)) {
+    pthread_cond_destroy(&output->queued);
+    pthread_cond_destroy(&output->written);
+    pthread_mutex_destroy(&output->lock);
+    fclose(output->fp);
+    free(output->buffer);
+    free(output);
+    return NULL;
+  }
+  return output;
+}
+
+void frame_output_write(FrameOutput* output, const Chip8* chip) {
+  assert(output);
+  assert(chip);
+  if (output->changed_only && output->count > 0 && output->last.hires == chip->hires
+      && !memcmp(output->last.pixels, chip->pixels, sizeof(output->last.pixels))) {
+    return;
+  }
+  memcpy(output->last.pixels, chip->pixels, sizeof(output->last.pixels));
+  output->last.hires = chip->hires;
+  output->count++;
+
+  pthread_mutex_lock(&output->lock);
+  while (output->used == QUEUE_SIZE) {
+    pthread_cond_wait(&output->written, &output->lock);
+  }
+  // The slot after the used ones is not touched by the writer
+  int tail = (output->head + output->used) % QUEUE_SIZE;
+  pthread_mutex_unlock(&output->lock);
+
+  output->queue[tail] = output->last;
+
+  pthread_mutex_lock(&output->lock);
+  output->used++;
+  pthread_cond_signal(&output->queued);
+  pthread_mutex_unlock(&output->lock);
+}
+
+int frame_output_close(FrameOutput* output) {
+  if (!output) {
+    return 0;
+  }
+  pthread_mutex_lock(&output->lock);
+  output->closing = 1;
+  pthread_cond_signal(&output->queued);
+  pthread_mutex_unlock(&output->lock);
+  pthread_join(output->thread, NULL);
+
+  pthread_cond_destroy(&output->queued);
+  pthread_cond_destroy(&output->written);
+  pthread_mutex_destroy(&output->lock);
+  int failed = output->failed || ferror(output->fp) || fclose(output->fp) != 0;
+  free(output->buffer);
+  free(output);
+  return failed ? 1 : 0;
+}
+
+long frame_output_count(const FrameOutput* output) {
+  assert(output);
+  return output->count;
+}
+
+
+// ----
+// Static functions
+
+static void* writer_main(void* arg) {
+  FrameOutput* output = arg;
+  for (;;) {
+    pthread_mutex_lock(&output->lock);
+    while (output->used == 0 && !output->closing) {
+      pthread_cond_wait(&output->queued, &output->lock);
+    }
+    if (output->used == 0) {
+      pthread_mutex_unlock(&output->lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&output->lock);
+
+    // The head slot stays ours until used goes down
+    const QueuedFrame* frame = &output->queue[output->head];
+    size_t size = output->format == FRAME_FORMAT_Y4M ? convert_y4m(output, frame, output->converted)
+                                                     : convert_pbm(frame, output->converted);
+    if (output->format == FRAME_FORMAT_Y4M) {
+      fputs("FRAME\n", output->fp);
+    } else {
+      fprintf(output->fp, "P4\n%d %d\n", DISPLAY_WIDTH, DISPLAY_HEGIHT);
+    }
+    if (fwrite(output->converted, 1, size, output->fp) != size) {
+      output->failed = 1;
+    }
+
+    pthread_mutex_lock(&output->lock);
+    output->head = (output->head + 1) % QUEUE_SIZE;
+    output->used--;
+    pthread_cond_signal(&output->written);
+    pthread_mutex_unlock(&output->lock);
+  }
+}
+
+static void fill_y4m_tables(FrameOutput* output) {
+  // Studio range BT.601 of the window palette: background, first plane,
+  // second plane, both planes
+  static const uint8_t palette[3][4] = {{16, 235, 133, 59}, {128, 128, 61, 103}, {128, 128, 202, 161}};
+  for (int channel = 0; channel < 3; channel++) {
+    for (int nibbles = 0; nibbles < 256; nibbles++) {
+      for (int i = 0; i < 4; i++) {
+        int bit = 3 - i;
+        uint8_t value = palette[channel][((nibbles >> bit) & 1) | ((nibbles >> (4 + bit)) & 1) << 1];
+        output->quads[channel][nibbles][i] = value;
+        output->doubled[channel][nibbles][2 * i] = value;
+        output->doubled[channel][nibbles][2 * i + 1] = value;
+      }
+    }
+  }
+}
+
+static size_t convert_y4m(const FrameOutput* output, const QueuedFrame* frame, uint8_t* out) {
+  // Four pixels at a time, a lores row is written twice at twice the width
+  int scale = frame->hires ? 1 : 2;
+  int words = frame->hires ? ROW_WORDS : 1;
+  for (int y = 0; y < DISPLAY_HEGIHT; y += scale) {
+    for (int channel = 0; channel < 3; channel++) {
+      uint8_t* row = out + channel * Y4M_PLANE_SIZE + y * DISPLAY_WIDTH;
+      for (int i = 0; i < words; i++) {
+        uint64_t first = frame->pixels[0][y / scale][i];
+        uint64_t second = frame->pixels[1][y / scale][i];
+        for (int shift = 60; shift >= 0; shift -= 4) {
+          int nibbles = ((first >> shift) & 0xF) | ((second >> shift) & 0xF) << 4;
+          if (scale == 1) {
+            memcpy(row, output->quads[channel][nibbles], 4);
+          } else {
+            memcpy(row, output->doubled[channel][nibbles], 8);
+          }
+          row += 4 * scale;
+        }
+      }
+      if (scale == 2) {
+        memcpy(row, row - DISPLAY_WIDTH, DISPLAY_WIDTH);
+      }
+    }
+  }
+  return 3 * Y4M_PLANE_SIZE;
+}
+
+static size_t convert_pbm(const QueuedFrame* frame, uint8_t* out) {
+  // Rows are packed most significant bit first, the same as the display
+  for (int y = 0; y < DISPLAY_HEGIHT; y++) {
+    uint8_t* row = out + y * DISPLAY_WIDTH / 8;
+    if (frame->hires) {
+      for (int i = 0; i < ROW_WORDS; i++) {
+        uint64_t word = frame->pixels[0][y][i] | frame->pixels[1][y][i];
+        for (int byte = 0; byte < 8; byte++) {
+          row[8 * i + byte] = word >> (56 - 8 * byte);
+        }
+      }
+      continue;
+    }
+    // A lores pixel covers two by two output pixels, every nibble of the
+    // source doubles into a byte
+    uint64_t word = frame->pixels[0][y / 2][0] | frame->pixels[1][y / 2][0];
+    for (int byte = 0; byte < DISPLAY_WIDTH / 8; byte++) {
+      uint8_t nibble = (word >> (60 - 4 * byte)) & 0xF;
+      uint8_t doubled = 0;
+      for (int bit = 3; bit >= 0; bit--) {
+        doubled = doubled << 2 | ((nibble >> bit) & 1) * 3;
+      }
+      row[byte] = doubled;
+    }
+  }
+  return PBM_FRAME_SIZE;
+}
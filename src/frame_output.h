@@ -0,0 +1,33 @@
+#ifndef FRAME_OUTPUT_H
+#define FRAME_OUTPUT_H
+
+#include "chip8.h"
+
+// Streams display frames to a file or pipe for video capture. Frames are
+// always DISPLAY_WIDTH x DISPLAY_HEGIHT, lores pixels are doubled.
+//
+// Y4M is a 4:4:4 stream at 60 frames per second in the window's colors,
+// readable by ffmpeg and most players. PBM writes one binary bitmap per
+// frame, a set bit is a pixel lit in any plane.
+//
+// The caller only copies the display into a queue, a background thread
+// converts and writes the frames through a large buffer. The caller waits
+// when the queue is full, so no frame is ever dropped.
+typedef enum {
+  FRAME_FORMAT_Y4M,
+  FRAME_FORMAT_PBM
+} FrameFormat;
+
+typedef struct FrameOutput FrameOutput;
+
+// filename "-" writes to stdout and points stdout at stderr for anything
+// else printed until exit. changed_only skips frames identical to the
+// previous one written, the stream no longer keeps time then.
+FrameOutput* frame_output_open(const char* filename, FrameFormat format, int changed_only);
+// Queues the current display of chip as the next frame
+void frame_output_write(FrameOutput* output, const Chip8* chip);
+// Writes the queued frames, returns 1 when a write failed
+int frame_output_close(FrameOutput* output);
+long frame_output_count(const FrameOutput* output);
+
+#endif
@@ -6,13 +6,8 @@
 #include <stdio.h>
 #include <assert.h>
 
-typedef struct {
-  float x, y;
-} Vec2;
-
-typedef struct {
-  Vec2 bl, br, tr, tl;
-} Square;
+static int display_size_location; // displaySize uniform, changes with the resolution
+static int uploaded_hires = -1;
 
 
 GLFWwindow* init_window(int width, int height, const char* title) {
@@ -43,75 +38,88 @@ GLFWwindow* init_window(int width, int height, const char* title) {
   return window;
 }
 
-static Vec2 translate_to_display(const int x, const int y) {
-  float new_x = ((2.0f * x) / WINDOW_WIDTH) - 1;
-  float new_y = ((-2.0f * y) / WINDOW_HEIGHT) + 1;
-  return (Vec2) {new_x, new_y};
+void setup_display(unsigned int* texture) {
+  // Core profile needs a bound vertex array even though the quad corners
+  // are generated from gl_VertexID
+  unsigned int vao;
+  glGenVertexArrays(1, &vao);
+  glBindVertexArray(vao);
+
+  // Display bitmap, every texel is 32 pixels of a row, most significant bit
+  // on the left. Red holds the first bitplane, green the second. Sized for
+  // hires, lores only reads the top left corner. Starts blank, the same as
+  // the rows upload_display remembers as shown.
+  static const uint32_t blank[DISPLAY_HEGIHT][DISPLAY_WIDTH / 32][DISPLAY_PLANES];
+  glGenTextures(1, texture);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, *texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, DISPLAY_WIDTH / 32, DISPLAY_HEGIHT, 0,
+               GL_RG_INTEGER, GL_UNSIGNED_INT, blank);
 }
 
-static void populate_pos_buffers(unsigned int* vbo_pos, unsigned int* ibo) {
-  int count = DISPLAY_WIDTH * DISPLAY_HEGIHT;
-  unsigned short base_index[] = {0, 1, 2, 2, 3, 0};
-  unsigned short index_data[count * INDEXES_PER_SQUARE];
-  unsigned short* index_ptr = index_data;
-  Square vertex_data[count];
-
-  int counter = 0;
-  int x = PIXEL_GAP;
-  int y = PIXEL_GAP;
-  for (int i = 0; i < DISPLAY_HEGIHT; i++) {
-    for (int j = 0; j < DISPLAY_WIDTH; j++) {
-      Square s = {
-        .tl = translate_to_display(x, y),
-        .tr = translate_to_display(x + PIXEL_SIZE, y),
-        .bl = translate_to_display(x, y + PIXEL_SIZE),
-        .br = translate_to_display(x + PIXEL_SIZE, y + PIXEL_SIZE)
-      };
-      vertex_data[counter] = s;
-
-      int offset = 4 * counter;
-      for (int k = 0; k < INDEXES_PER_SQUARE; k++) {
-        index_ptr[k] = base_index[k] + offset;
+void upload_display(unsigned int texture, const uint64_t* pixels, int hires, uint64_t dirty_rows) {
+  // pixels holds DISPLAY_PLANES planes of DISPLAY_HEGIHT rows of ROW_WORDS words
+  assert(pixels);
+  int height = hires ? DISPLAY_HEGIHT : LORES_HEIGHT;
+  int words = hires ? ROW_WORDS : 1;
+  static uint32_t texels[DISPLAY_HEGIHT][DISPLAY_WIDTH / 32][DISPLAY_PLANES];
+  static uint64_t shown[DISPLAY_PLANES][DISPLAY_HEGIHT][ROW_WORDS]; // last uploaded rows
+
+  // A new resolution redraws everything
+  if (hires != uploaded_hires) {
+    dirty_rows = ~0ULL;
+  }
+  if (height < 64) {
+    dirty_rows &= (1ULL << height) - 1;
+  }
+  for (int row = 0; row < height; row++) {
+    if (!((dirty_rows >> row) & 1)) {
+      continue;
+    }
+    // Rows a sprite XORed back to what they were need no upload
+    int changed = hires != uploaded_hires;
+    for (int plane = 0; plane < DISPLAY_PLANES; plane++) {
+      const uint64_t* source = pixels + (plane * DISPLAY_HEGIHT + row) * ROW_WORDS;
+      for (int i = 0; i < words; i++) {
+        changed |= shown[plane][row][i] != source[i];
+        shown[plane][row][i] = source[i];
+        texels[row][2 * i][plane] = (uint32_t)(source[i] >> 32);
+        texels[row][2 * i + 1][plane] = (uint32_t)source[i];
       }
-      index_ptr += INDEXES_PER_SQUARE;
+    }
+    if (!changed) {
+      dirty_rows &= ~(1ULL << row);
+    }
+  }
 
-      x = x + PIXEL_SIZE + PIXEL_GAP;
-      counter++;
+  // One upload per run of consecutive changed rows
+  glBindTexture(GL_TEXTURE_2D, texture);
+  int row = 0;
+  while (row < height) {
+    if (!((dirty_rows >> row) & 1)) {
+      row++;
+      continue;
+    }
+    int end = row;
+    while (end < height && ((dirty_rows >> end) & 1)) {
+      end++;
     }
-    y = y + PIXEL_SIZE + PIXEL_GAP;
-    x = PIXEL_GAP;
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, row, DISPLAY_WIDTH / 32, end - row,
+                    GL_RG_INTEGER, GL_UNSIGNED_INT, texels[row]);
+    row = end;
   }
 
-  glBindBuffer(GL_ARRAY_BUFFER, *vbo_pos);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(vertex_data), vertex_data, GL_STATIC_DRAW);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *ibo);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(index_data), index_data, GL_STATIC_DRAW);
+  if (hires != uploaded_hires) {
+    glUniform2f(display_size_location, hires ? DISPLAY_WIDTH : LORES_WIDTH,
+                hires ? DISPLAY_HEGIHT : LORES_HEIGHT);
+    uploaded_hires = hires;
+  }
 }
 
-int setup_buffers(unsigned int* vbo_pos, unsigned int* vbo_color, unsigned int* ibo) {
-  // Vertex Array Object
-  unsigned int vao;
-  glGenVertexArrays(1, &vao);
-  glBindVertexArray(vao);
-
-  // Vertex Buffer Object Positions
-  glGenBuffers(1, vbo_pos);
-  glBindBuffer(GL_ARRAY_BUFFER, *vbo_pos);
-  glEnableVertexAttribArray(0);
-  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
-  // Index Buffer Object
-  glGenBuffers(1, ibo);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *ibo);
-  // Vertex Buffer Object Colors
-  glGenBuffers(1, vbo_color);
-  glBindBuffer(GL_ARRAY_BUFFER, *vbo_color);
-  glBufferData(GL_ARRAY_BUFFER, 4 * DISPLAY_HEGIHT * DISPLAY_WIDTH * sizeof(unsigned short), NULL, GL_DYNAMIC_DRAW);
-  glEnableVertexAttribArray(1);
-  glVertexAttribPointer(1, 1, GL_UNSIGNED_SHORT, GL_FALSE, 0, 0);
-
-  populate_pos_buffers(vbo_pos, ibo);
-
-  return DISPLAY_WIDTH * DISPLAY_HEGIHT * INDEXES_PER_SQUARE;
+void draw_display() {
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 }
 
 
@@ -156,28 +164,38 @@ int install_shaders() {
   const char vertex_shader_source[] =
     "#version 330 core\n"
     "\n"
-    "layout(location = 0) in vec4 position;\n"
-    "layout(location = 1) in uint color;\n"
-    "\n"
-    "out vec3 vColor;\n"
+    "out vec2 vPosition;\n"
     "\n"
     "void main() {\n"
-    "  gl_Position = position;\n"
-    "  if (bool(color)) {\n"
-    "    vColor = vec3(1.0, 1.0, 1.0);\n"
-    "  } else {\n"
-    "    vColor = vec3(0.0, 0.0, 0.0);\n"
-    "  }\n"
+    "  // Fullscreen triangle strip, display position 0,0 is the top left\n"
+    "  vPosition = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+    "  gl_Position = vec4(vPosition.x * 2.0 - 1.0, 1.0 - vPosition.y * 2.0, 0.0, 1.0);\n"
     "}";
   const char fragment_shader_source[] =
     "#version 330 core\n"
     "\n"
     "layout(location = 0) out vec4 color;\n"
     "\n"
-    "in vec3 vColor;\n"
+    "in vec2 vPosition;\n"
+    "\n"
+    "uniform usampler2D display;\n"
+    "uniform vec2 displaySize;\n"
+    "uniform float pixelGap;\n"
+    "\n"
+    "// Background, first plane, second plane, both planes\n"
+    "const vec3 palette[4] = vec3[4](vec3(0.0, 0.0, 0.0), vec3(1.0, 1.0, 1.0),\n"
+    "                                vec3(1.0, 0.4, 0.0), vec3(0.4, 0.13, 0.0));\n"
     "\n"
     "void main() {\n"
-    "  color = vec4(vColor, 1.0);\n"
+    "  vec2 cell = vPosition * displaySize;\n"
+    "  ivec2 pixel = min(ivec2(cell), ivec2(displaySize) - 1);\n"
+    "  vec2 inside = fract(cell);\n"
+    "  uvec2 words = texelFetch(display, ivec2(pixel.x / 32, pixel.y), 0).rg;\n"
+    "  uint shift = uint(31 - pixel.x % 32);\n"
+    "  uint index = ((words.r >> shift) & 1u) | (((words.g >> shift) & 1u) << 1);\n"
+    "  // Each pixel starts with a gap on its top and left edge\n"
+    "  bool lit = index != 0u && inside.x >= pixelGap && inside.y >= pixelGap;\n"
+    "  color = vec4(palette[lit ? index : 0u], 1.0);\n"
     "}";
 
   unsigned int vshader, fshader;
@@ -206,6 +224,11 @@ int install_shaders() {
   }
 
   glUseProgram(program);
+  glUniform1i(glGetUniformLocation(program, "display"), 0);
+  display_size_location = glGetUniformLocation(program, "displaySize");
+  glUniform2f(display_size_location, LORES_WIDTH, LORES_HEIGHT);
+  uploaded_hires = 0;
+  glUniform1f(glGetUniformLocation(program, "pixelGap"), (float)PIXEL_GAP / (PIXEL_SIZE + PIXEL_GAP));
 
   return 0;
 }
@@ -3,16 +3,19 @@
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <stdint.h>
 
 #define WINDOW_WIDTH 1024
 #define WINDOW_HEIGHT 512
 #define PIXEL_SIZE 14
 #define PIXEL_GAP 2
-#define INDEXES_PER_SQUARE 6
 
 GLFWwindow* init_window(int width, int height, const char* title);
 int install_shaders();
-int setup_buffers(unsigned int* vbo_pos, unsigned int* vbo_color, unsigned int* ibo);
+void setup_display(unsigned int* texture);
+// Uploads the rows in dirty_rows that differ from what is shown
+void upload_display(unsigned int texture, const uint64_t* pixels, int hires, uint64_t dirty_rows);
+void draw_display();
 
 void toggleFullScreen(GLFWwindow* window);
 
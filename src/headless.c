@@ -0,0 +1,743 @@
+#define _POSIX_C_SOURCE 200809L // Needed for getopt and clock_gettime
+
+#include "chip8.h"
+#include "jit.h"
+#include "engine.h"
+#include "profile.h"
+#include "trace.h"
+#include "movie.h"
+#include "library.h"
+#include "frame_output.h"
+#include "audio.h"
+#include "lockstep.h"
+#include "vec_env.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_FRAMES 600
+
+typedef enum {
+  BACKEND_INTERPRETER,
+  BACKEND_JIT,
+  BACKEND_VALIDATE, // JIT checked against the interpreter after every frame
+  BACKEND_LOCKSTEP, // every instance on one core in SIMD lockstep
+  BACKEND_LOCKSTEP_VALIDATE, // lockstep checked against the interpreter after every frame
+  BACKEND_VEC_ENV // engine stepped as a vectorized environment, observations checked every frame
+} Backend;
+
+typedef struct {
+  long frames; // frames to run, used when instructions is 0
+  long instructions; // instructions to run, overrides frames
+  long ipf; // instructions per frame, timers tick after every batch
+  int quiet; // skip the state dump
+  uint8_t quirks; // CHIP8_QUIRK_* flags
+  Backend backend;
+  int instances; // copies of the ROM stepped in parallel
+  int threads; // worker threads for parallel runs, 0 uses every CPU
+  uint64_t seed; // random seed, parallel instance i uses seed + i
+  uint16_t reward_address; // memory byte observed as the reward by -b vecenv
+  const char* resume_file; // state to start from instead of a fresh machine
+  const char* save_file; // where to write the final state
+  const char* trace_file; // where to write the execution trace
+  const char* movie_file; // input to replay, sets the seed, quirks and frames
+  int library; // filename is a ROM library, every ROM runs with its own settings
+  const char* frame_file; // where to stream the display after every frame, - for stdout
+  FrameFormat frame_format;
+  int changed_frames; // stream only frames that differ from the previous one
+  const char* audio_file; // where to write the sound as WAV
+  const char* filename;
+} Options;
+
+static int parse_options(int argc, char* argv[], Options* options);
+// run and replay return the instructions executed, -1 when the JIT diverged
+static long run(Chip8* chip, Chip8Jit* jit, TraceWriter* trace, FrameOutput* frames, AudioEngine* audio,
+                long instructions, long ipf, Backend backend);
+static int run_batch(Chip8* chip, Chip8Jit* jit, TraceWriter* trace, long count, Backend backend);
+static long replay(Chip8* chip, Chip8Jit* jit, TraceWriter* trace, FrameOutput* frames, AudioEngine* audio,
+                   const Movie* movie, Backend backend);
+static int run_parallel(Options* options, long frames);
+static int run_lockstep(Options* options, long frames);
+static int run_vec_env(Options* options, long frames);
+static int run_library(Options* options);
+static int same_state(Chip8* a, Chip8* b);
+static uint8_t* read_file(const char* filename, size_t* size);
+static int read_state(Chip8* chip, const char* filename);
+static int write_state(Chip8* chip, const char* filename);
+static void dump_state(Chip8* chip);
+static double current_time_seconds();
+
+
+int main(int argc, char* argv[]) {
+  Options options = {
+    .frames = DEFAULT_FRAMES,
+    .instructions = 0,
+    .ipf = CHIP8_DEFAULT_IPF,
+    .quiet = 0,
+    .quirks = 0,
+    .backend = BACKEND_INTERPRETER,
+    .instances = 1,
+    .threads = 0,
+    .seed = CHIP8_DEFAULT_SEED,
+    .reward_address = 0,
+    .resume_file = NULL,
+    .save_file = NULL,
+    .trace_file = NULL,
+    .movie_file = NULL,
+    .library = 0,
+    .frame_file = NULL,
+    .frame_format = FRAME_FORMAT_Y4M,
+    .changed_frames = 0,
+    .audio_file = NULL,
+    .filename = NULL
+  };
+  if (parse_options(argc, argv, &options)) {
+    printf("Usage: %s [-f frames] [-i instructions] [-p instructions per frame] [-b interpreter|jit|validate|lockstep|lockstep-validate|vecenv] [-n instances] [-t threads] [-s seed] [-r reward address] [-R state file] [-W state file] [-T trace file] [-M movie file] [-Q quirks] [-o frame file] [-O y4m|pbm] [-c] [-a wav file] [-w] [-L] [-q] <filename>\n", argv[0]);
+    return 0;
+  }
+
+  if (options.library) {
+    return run_library(&options);
+  }
+  if (options.backend == BACKEND_LOCKSTEP || options.backend == BACKEND_LOCKSTEP_VALIDATE) {
+    long frames = options.instructions ? options.instructions / options.ipf : options.frames;
+    return run_lockstep(&options, frames);
+  }
+  if (options.backend == BACKEND_VEC_ENV) {
+    long frames = options.instructions ? options.instructions / options.ipf : options.frames;
+    return run_vec_env(&options, frames);
+  }
+  if (options.instances > 1) {
+    long frames = options.instructions ? options.instructions / options.ipf : options.frames;
+    return run_parallel(&options, frames);
+  }
+
+  Chip8Jit* jit = NULL;
+  if (options.backend != BACKEND_INTERPRETER) {
+    jit = chip8_jit_create();
+    if (!jit) {
+      printf("JIT is not available on this host\n");
+      return -1;
+    }
+  }
+
+  Movie* movie = NULL;
+  if (options.movie_file) {
+    movie = movie_load(options.movie_file);
+    if (!movie) {
+      printf("Failed to load movie: %s\n", options.movie_file);
+      return -1;
+    }
+    options.seed = movie->seed;
+    options.quirks = movie->quirks;
+    options.ipf = movie->ipf;
+  }
+
+  static Chip8 chip; // too large for the stack with 64KB of memory
+  chip8_init(&chip);
+  chip8_seed(&chip, options.seed);
+  chip8_set_quirks(&chip, options.quirks);
+  if (chip8_load_file(&chip, options.filename)) {
+    printf("Failed to load file: %s\n", options.filename);
+    return -1;
+  }
+  if (options.resume_file && read_state(&chip, options.resume_file)) {
+    printf("Failed to load state: %s\n", options.resume_file);
+    return -1;
+  }
+
+  long instructions = options.instructions;
+  if (!instructions) {
+    instructions = options.frames * options.ipf;
+  }
+
+  TraceWriter* trace = NULL;
+  if (options.trace_file) {
+    trace = trace_writer_open(options.trace_file, &chip);
+    if (!trace) {
+      printf("Failed to create trace: %s\n", options.trace_file);
+      return -1;
+    }
+  }
+
+  FrameOutput* frames = NULL;
+  if (options.frame_file) {
+    frames = frame_output_open(options.frame_file, options.frame_format, options.changed_frames);
+    if (!frames) {
+      printf("Failed to create frame output: %s\n", options.frame_file);
+      return -1;
+    }
+  }
+
+  AudioEngine* audio = NULL;
+  if (options.audio_file) {
+    audio = audio_create(audio_wav_sink(options.audio_file));
+    if (!audio) {
+      printf("Failed to create audio output: %s\n", options.audio_file);
+      return -1;
+    }
+  }
+
+  double start = current_time_seconds();
+  long executed = movie ? replay(&chip, jit, trace, frames, audio, movie, options.backend)
+                        : run(&chip, jit, trace, frames, audio, instructions, options.ipf, options.backend);
+  double elapsed = current_time_seconds() - start;
+  chip8_jit_destroy(jit);
+  movie_destroy(movie);
+  if (trace_writer_close(trace)) {
+    printf("Failed to write trace: %s\n", options.trace_file);
+    return -1;
+  }
+  if (frames) {
+    long count = frame_output_count(frames);
+    if (frame_output_close(frames)) {
+      fprintf(stderr, "Failed to write frames: %s\n", options.frame_file);
+      return -1;
+    }
+    fprintf(stderr, "%ld frames written\n", count);
+  }
+  if (audio_destroy(audio)) {
+    printf("Failed to write audio: %s\n", options.audio_file);
+    return -1;
+  }
+
+  if (!options.quiet) {
+    dump_state(&chip);
+  }
+  if (executed < 0) {
+    return -1;
+  }
+  if (options.save_file && write_state(&chip, options.save_file)) {
+    printf("Failed to save state: %s\n", options.save_file);
+    return -1;
+  }
+  fprintf(stderr, "%ld instructions in %.6f s (%.2f MIPS)\n",
+          executed, elapsed, elapsed > 0 ? executed / elapsed / 1e6 : 0.0);
+#ifdef CHIP8_PROFILE
+  if (profile_report(stderr, PROFILE_JSON_FILE)) {
+    printf("Failed to write profile: %s\n", PROFILE_JSON_FILE);
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+
+static int parse_options(int argc, char* argv[], Options* options) {
+  assert(options);
+  int opt;
+  while ((opt = getopt(argc, argv, "f:i:p:b:n:t:s:r:R:W:T:M:Q:o:O:ca:wLq")) != -1) {
+    switch (opt) {
+      case 'f':
+        options->frames = atol(optarg);
+        break;
+      case 'i':
+        options->instructions = atol(optarg);
+        break;
+      case 'p':
+        options->ipf = atol(optarg);
+        break;
+      case 'b':
+        if (!strcmp(optarg, "interpreter")) {
+          options->backend = BACKEND_INTERPRETER;
+        } else if (!strcmp(optarg, "jit")) {
+          options->backend = BACKEND_JIT;
+        } else if (!strcmp(optarg, "validate")) {
+          options->backend = BACKEND_VALIDATE;
+        } else if (!strcmp(optarg, "lockstep")) {
+          options->backend = BACKEND_LOCKSTEP;
+        } else if (!strcmp(optarg, "lockstep-validate")) {
+          options->backend = BACKEND_LOCKSTEP_VALIDATE;
+        } else if (!strcmp(optarg, "vecenv")) {
+          options->backend = BACKEND_VEC_ENV;
+        } else {
+          return 1;
+        }
+        break;
+      case 'n':
+        options->instances = atoi(optarg);
+        break;
+      case 't':
+        options->threads = atoi(optarg);
+        break;
+      case 's':
+        options->seed = strtoull(optarg, NULL, 0);
+        break;
+      case 'r':
+        options->reward_address = (uint16_t)strtoul(optarg, NULL, 0);
+        break;
+      case 'R':
+        options->resume_file = optarg;
+        break;
+      case 'W':
+        options->save_file = optarg;
+        break;
+      case 'T':
+        options->trace_file = optarg;
+        break;
+      case 'M':
+        options->movie_file = optarg;
+        break;
+      case 'Q':
+        options->quirks |= strtoul(optarg, NULL, 0);
+        break;
+      case 'o':
+        options->frame_file = optarg;
+        break;
+      case 'O':
+        if (!strcmp(optarg, "y4m")) {
+          options->frame_format = FRAME_FORMAT_Y4M;
+        } else if (!strcmp(optarg, "pbm")) {
+          options->frame_format = FRAME_FORMAT_PBM;
+        } else {
+          return 1;
+        }
+        break;
+      case 'c':
+        options->changed_frames = 1;
+        break;
+      case 'a':
+        options->audio_file = optarg;
+        break;
+      case 'w':
+        options->quirks |= CHIP8_QUIRK_WRAP;
+        break;
+      case 'L':
+        options->library = 1;
+        break;
+      case 'q':
+        options->quiet = 1;
+        break;
+      default:
+        return 1;
+    }
+  }
+  if (optind != argc - 1 || options->ipf <= 0 || options->frames < 0 || options->instructions < 0) {
+    return 1;
+  }
+  int lockstep = options->backend == BACKEND_LOCKSTEP || options->backend == BACKEND_LOCKSTEP_VALIDATE;
+  int vec_env = options->backend == BACKEND_VEC_ENV;
+  if (options->instances < 1
+      || (options->instances > 1 && options->backend != BACKEND_INTERPRETER && !lockstep && !vec_env)) {
+    return 1;
+  }
+  // Lockstep and environment instances all start from the ROM and only report instance 0
+  if ((lockstep || vec_env) && (options->resume_file || options->save_file || options->movie_file
+                   || options->frame_file || options->audio_file)) {
+    return 1;
+  }
+  // Traces are recorded by the interpreter of a single instance
+  if (options->trace_file && (options->instances > 1 || options->backend != BACKEND_INTERPRETER)) {
+    return 1;
+  }
+  if (options->movie_file && options->instances > 1) {
+    return 1;
+  }
+  // Libraries run one instance per ROM on the engine, from a fresh machine
+  if (options->library && (options->instances > 1 || options->backend != BACKEND_INTERPRETER
+                           || options->instructions || options->resume_file || options->save_file
+                           || options->trace_file || options->movie_file)) {
+    return 1;
+  }
+  // Frames and sound come from a single instance
+  if ((options->frame_file || options->audio_file) && (options->instances > 1 || options->library)) {
+    return 1;
+  }
+  options->filename = argv[optind];
+  return 0;
+}
+
+static long run(Chip8* chip, Chip8Jit* jit, TraceWriter* trace, FrameOutput* frames, AudioEngine* audio,
+                long instructions, long ipf, Backend backend) {
+  assert(chip);
+  long executed = 0;
+  while (executed < instructions) {
+    long batch = instructions - executed;
+    if (batch > ipf) {
+      batch = ipf;
+    }
+    if (run_batch(chip, jit, trace, batch, backend)) {
+      fprintf(stderr, "JIT diverged from the interpreter within instructions %ld to %ld\n",
+              executed, executed + batch);
+      return -1;
+    }
+    executed += batch;
+    if (batch == ipf) {
+      if (audio) {
+        audio_push(audio, chip);
+      }
+      chip8_timer_tick(chip);
+      if (frames) {
+        frame_output_write(frames, chip);
+      }
+    }
+  }
+  return executed;
+}
+
+static int run_batch(Chip8* chip, Chip8Jit* jit, TraceWriter* trace, long count, Backend backend) {
+  if (trace) {
+    for (long i = 0; i < count; i++) {
+      trace_writer_step(trace, chip);
+    }
+    return 0;
+  }
+  if (backend == BACKEND_INTERPRETER) {
+    // A machine waiting for the timer or a key skips the rest of the batch
+    chip8_run(chip, count);
+    return 0;
+  }
+  if (backend == BACKEND_JIT) {
+    chip8_jit_run(jit, chip, count);
+    return 0;
+  }
+
+  // The copy carries the random state, both sides draw the same numbers
+  static Chip8 reference;
+  memcpy(&reference, chip, sizeof(Chip8));
+  for (long i = 0; i < count; i++) {
+    chip8_step(&reference);
+  }
+  chip8_jit_run(jit, chip, count);
+  return !same_state(chip, &reference);
+}
+
+static long replay(Chip8* chip, Chip8Jit* jit, TraceWriter* trace, FrameOutput* frames, AudioEngine* audio,
+                   const Movie* movie, Backend backend) {
+  // Same frame as the window: keys, a frame of instructions, timer tick
+  assert(chip);
+  assert(movie);
+  long executed = 0;
+  for (long frame = 0; frame < movie->frames; frame++) {
+    chip->keys = movie->keys[frame];
+    if (run_batch(chip, jit, trace, movie->ipf, backend)) {
+      fprintf(stderr, "JIT diverged from the interpreter in frame %ld\n", frame);
+      return -1;
+    }
+    executed += movie->ipf;
+    if (audio) {
+      audio_push(audio, chip);
+    }
+    chip8_timer_tick(chip);
+    if (frames) {
+      frame_output_write(frames, chip);
+    }
+  }
+  return executed;
+}
+
+static int run_parallel(Options* options, long frames) {
+  Chip8Engine* engine = chip8_engine_create(options->instances, options->threads);
+  if (!engine) {
+    printf("Failed to create %d instances\n", options->instances);
+    return -1;
+  }
+  for (int i = 0; i < options->instances; i++) {
+    Chip8* chip = chip8_engine_instance(engine, i);
+    chip8_seed(chip, options->seed + i);
+    chip8_set_quirks(chip, options->quirks);
+    if (chip8_load_file(chip, options->filename)) {
+      printf("Failed to load file: %s\n", options->filename);
+      chip8_engine_destroy(engine);
+      return -1;
+    }
+    chip8_engine_set_budget(engine, i, options->ipf, frames);
+  }
+
+  double start = current_time_seconds();
+  chip8_engine_run(engine, frames);
+  double elapsed = current_time_seconds() - start;
+
+  if (!options->quiet) {
+    dump_state(chip8_engine_instance(engine, 0));
+  }
+  long executed = frames * options->ipf * options->instances;
+  fprintf(stderr, "%d instances, %ld instructions in %.6f s (%.2f MIPS)\n",
+          options->instances, executed, elapsed, elapsed > 0 ? executed / elapsed / 1e6 : 0.0);
+  chip8_engine_destroy(engine);
+  return 0;
+}
+
+static int run_lockstep(Options* options, long frames) {
+  static Chip8 prototype;
+  chip8_init(&prototype);
+  chip8_set_quirks(&prototype, options->quirks);
+  if (chip8_load_file(&prototype, options->filename)) {
+    printf("Failed to load file: %s\n", options->filename);
+    return -1;
+  }
+  Chip8Lockstep* lockstep = chip8_lockstep_create(options->instances, &prototype, options->seed);
+  if (!lockstep) {
+    printf("Failed to create %d instances\n", options->instances);
+    return -1;
+  }
+
+  // Validation runs a second copy of every instance on the interpreter
+  Chip8* reference = NULL;
+  if (options->backend == BACKEND_LOCKSTEP_VALIDATE) {
+    reference = malloc(options->instances * sizeof(Chip8));
+    if (!reference) {
+      printf("Failed to create %d instances\n", options->instances);
+      chip8_lockstep_destroy(lockstep);
+      return -1;
+    }
+    for (int i = 0; i < options->instances; i++) {
+      memcpy(&reference[i], &prototype, sizeof(Chip8));
+      chip8_seed(&reference[i], options->seed + i);
+    }
+  }
+
+  int failed = 0;
+  double start = current_time_seconds();
+  if (!reference) {
+    chip8_lockstep_run(lockstep, options->ipf, frames);
+  }
+  for (long frame = 0; reference && frame < frames && !failed; frame++) {
+    chip8_lockstep_run(lockstep, options->ipf, 1);
+    for (int i = 0; i < options->instances; i++) {
+      chip8_run(&reference[i], options->ipf);
+      chip8_timer_tick(&reference[i]);
+      if (!same_state(chip8_lockstep_instance(lockstep, i), &reference[i])) {
+        fprintf(stderr, "Lockstep instance %d diverged from the interpreter in frame %ld\n", i, frame);
+        failed = 1;
+        break;
+      }
+    }
+  }
+  double elapsed = current_time_seconds() - start;
+
+  if (!options->quiet) {
+    dump_state(chip8_lockstep_instance(lockstep, 0));
+  }
+  long vector;
+  long scalar;
+  chip8_lockstep_stats(lockstep, &vector, &scalar);
+  long executed = vector + scalar;
+  fprintf(stderr, "%d instances, %ld instructions in %.6f s (%.2f MIPS), %.1f%% vectorized\n",
+          options->instances, executed, elapsed, elapsed > 0 ? executed / elapsed / 1e6 : 0.0,
+          executed > 0 ? 100.0 * vector / executed : 0.0);
+  free(reference);
+  chip8_lockstep_destroy(lockstep);
+  return failed ? -1 : 0;
+}
+
+static int run_vec_env(Options* options, long frames) {
+  size_t size;
+  uint8_t* rom = read_file(options->filename, &size);
+  if (!rom) {
+    printf("Failed to load file: %s\n", options->filename);
+    return -1;
+  }
+  Chip8VecEnv* env = size ? chip8_vec_env_create(options->instances, options->threads, rom, size, options->seed) : NULL;
+  free(rom);
+  if (!env) {
+    printf("Failed to create %d instances\n", options->instances);
+    return -1;
+  }
+  chip8_vec_env_set_quirks(env, options->quirks);
+  chip8_vec_env_set_ipf(env, options->ipf);
+  chip8_vec_env_set_reward_address(env, options->reward_address);
+
+  // No keys are held, so instance 0 ends like a plain run
+  uint16_t* keys = calloc(options->instances, sizeof(uint16_t));
+  uint8_t* buffer = malloc(chip8_vec_env_buffer_size(env));
+  if (!keys || !buffer) {
+    printf("Failed to create %d instances\n", options->instances);
+    free(keys);
+    free(buffer);
+    chip8_vec_env_destroy(env);
+    return -1;
+  }
+
+  // Every step is one frame, the observations written by the workers are
+  // checked against the instances they came from
+  int failed = 0;
+  long frame = 0;
+  double start = current_time_seconds();
+  for (; frame < frames && !failed; frame++) {
+    chip8_vec_env_step(env, keys, 1, buffer);
+    const uint8_t* rewards = buffer + (size_t)options->instances * CHIP8_VEC_ENV_PIXELS_SIZE;
+    for (int i = 0; i < options->instances; i++) {
+      Chip8* chip = chip8_vec_env_instance(env, i);
+      if (memcmp(buffer + (size_t)i * CHIP8_VEC_ENV_PIXELS_SIZE, chip->pixels, CHIP8_VEC_ENV_PIXELS_SIZE)
+          || rewards[i] != chip->memory[options->reward_address]) {
+        fprintf(stderr, "Observation of instance %d differs from its state in frame %ld\n", i, frame);
+        failed = 1;
+        break;
+      }
+    }
+  }
+  double elapsed = current_time_seconds() - start;
+
+  if (!options->quiet) {
+    dump_state(chip8_vec_env_instance(env, 0));
+  }
+  long executed = frame * options->ipf * options->instances;
+  fprintf(stderr, "%d instances, %ld instructions in %.6f s (%.2f MIPS)\n",
+          options->instances, executed, elapsed, elapsed > 0 ? executed / elapsed / 1e6 : 0.0);
+  free(keys);
+  free(buffer);
+  chip8_vec_env_destroy(env);
+  return failed ? -1 : 0;
+}
+
+static int run_library(Options* options) {
+  Library* library = library_open(options->filename);
+  if (!library) {
+    printf("Failed to open ROM library: %s\n", options->filename);
+    return -1;
+  }
+  if (library_ignored_lines(library)) {
+    printf("Ignored %ld lines of %s\n", library_ignored_lines(library), LIBRARY_DATABASE);
+  }
+  int count = library_count(library);
+  Chip8Engine* engine = chip8_engine_create(count, options->threads);
+  uint8_t* skipped = calloc(count, 1); // ROMs that could not be loaded, they never run
+  if (!engine || !skipped) {
+    printf("Failed to create %d instances\n", count);
+    chip8_engine_destroy(engine);
+    free(skipped);
+    library_close(library);
+    return -1;
+  }
+  int loaded = 0;
+  long executed = 0;
+  for (int i = 0; i < count; i++) {
+    const LibraryRom* rom = library_rom(library, i);
+    Chip8* chip = chip8_engine_instance(engine, i);
+    chip8_seed(chip, options->seed);
+    chip8_set_quirks(chip, rom->quirks | options->quirks);
+    if (chip8_load_rom(chip, rom->data, rom->size)) {
+      printf("ROM too large: %s\n", rom->name);
+      skipped[i] = 1;
+      continue;
+    }
+    chip8_engine_set_budget(engine, i, rom->ipf, options->frames);
+    executed += rom->ipf * options->frames;
+    loaded++;
+  }
+
+  double start = current_time_seconds();
+  chip8_engine_run(engine, options->frames);
+  double elapsed = current_time_seconds() - start;
+
+  if (!options->quiet) {
+    // One line per ROM: hash, profile (? when guessed), settings, final PC
+    // or skipped when the ROM did not run
+    for (int i = 0; i < count; i++) {
+      const LibraryRom* rom = library_rom(library, i);
+      for (int j = 0; j < LIBRARY_SHA1_SIZE; j++) {
+        printf("%02x", rom->sha1[j]);
+      }
+      printf(" %-6s%c quirks:%02X ipf:%-4ld ", rom->platform, rom->known ? ' ' : '?',
+             chip8_engine_instance(engine, i)->quirks, rom->ipf);
+      if (skipped[i]) {
+        printf("skipped %s\n", rom->name);
+      } else {
+        printf("PC:%04X %s\n", chip8_engine_instance(engine, i)->PC, rom->name);
+      }
+    }
+  }
+  fprintf(stderr, "%d ROMs, %ld instructions in %.6f s (%.2f MIPS)\n",
+          loaded, executed, elapsed, elapsed > 0 ? executed / elapsed / 1e6 : 0.0);
+  free(skipped);
+  chip8_engine_destroy(engine);
+  library_close(library);
+  return 0;
+}
+
+static int same_state(Chip8* a, Chip8* b) {
+  return a->PC == b->PC && a->I == b->I && a->SP == b->SP && a->DT == b->DT && a->ST == b->ST
+         && a->rng == b->rng && a->hires == b->hires && a->planes == b->planes && a->pitch == b->pitch
+         && !memcmp(a->flags, b->flags, sizeof(a->flags))
+         && !memcmp(a->pattern, b->pattern, sizeof(a->pattern))
+         && !memcmp(a->registers, b->registers, sizeof(a->registers))
+         && !memcmp(a->stack, b->stack, sizeof(a->stack))
+         && !memcmp(a->pixels, b->pixels, sizeof(a->pixels))
+         && !memcmp(a->memory, b->memory, sizeof(a->memory));
+}
+
+static uint8_t* read_file(const char* filename, size_t* size) {
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  long file_size = ftell(fp);
+  rewind(fp);
+  // One spare byte so an empty file still gets a buffer
+  uint8_t* buffer = file_size >= 0 ? malloc(file_size + 1) : NULL;
+  if (buffer && fread(buffer, 1, file_size, fp) != (size_t)file_size) {
+    free(buffer);
+    buffer = NULL;
+  }
+  fclose(fp);
+  *size = file_size;
+  return buffer;
+}
+
+static int read_state(Chip8* chip, const char* filename) {
+  uint8_t* buffer = malloc(CHIP8_STATE_SIZE); // too large for the stack with 64KB of memory
+  FILE* fp = buffer ? fopen(filename, "rb") : NULL;
+  if (!fp) {
+    free(buffer);
+    return 1;
+  }
+  size_t size = fread(buffer, 1, CHIP8_STATE_SIZE, fp);
+  fclose(fp);
+  int result = chip8_load_state(chip, buffer, size);
+  free(buffer);
+  return result;
+}
+
+static int write_state(Chip8* chip, const char* filename) {
+  uint8_t* buffer = malloc(CHIP8_STATE_SIZE);
+  FILE* fp = buffer ? fopen(filename, "wb") : NULL;
+  if (!fp) {
+    free(buffer);
+    return 1;
+  }
+  size_t size = chip8_save_state(chip, buffer, CHIP8_STATE_SIZE);
+  size_t written = fwrite(buffer, 1, size, fp);
+  fclose(fp);
+  free(buffer);
+  return written != size;
+}
+
+static void dump_state(Chip8* chip) {
+  assert(chip);
+  for (int i = 0; i < REGISTERS_SIZE; i++) {
+    printf("V%X:%02X ", i, chip->registers[i]);
+  }
+  printf("\nI:%04X PC:%04X SP:%02X DT:%02X ST:%02X\n", chip->I, chip->PC, chip->SP, chip->DT, chip->ST);
+  printf("Stack:");
+  for (int i = 0; i < STACK_SIZE; i++) {
+    printf(" %04X", chip->stack[i]);
+  }
+  printf("\n");
+
+  // One character per pixel, the XO-CHIP planes pick between # + and @
+  const char colors[] = ".#+@";
+  int width = chip->hires ? DISPLAY_WIDTH : LORES_WIDTH;
+  int height = chip->hires ? DISPLAY_HEGIHT : LORES_HEIGHT;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int shift = 63 - x % 64;
+      int color = (chip->pixels[0][y][x / 64] >> shift) & 0x1;
+      color |= ((chip->pixels[1][y][x / 64] >> shift) & 0x1) << 1;
+      putchar(colors[color]);
+    }
+    putchar('\n');
+  }
+}
+
+static double current_time_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
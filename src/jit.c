@@ -0,0 +1,554 @@
+#define _DEFAULT_SOURCE // Needed for MAP_ANONYMOUS
+
+#include "jit.h"
+#include "chip8.h"
+#include "profile.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CODE_SIZE (1 << 20)
+#define MAX_BLOCK_INSTRUCTIONS 64
+#define MAX_INSTRUCTION_BYTES 32 // longest sequence emitted for one instruction
+#define MAX_BLOCK_BYTES (MAX_BLOCK_INSTRUCTIONS * MAX_INSTRUCTION_BYTES + 16)
+
+// Operand offsets inside Chip8, generated code gets the Chip8 pointer in rdi
+#define OFFSET_REGISTER(x) (offsetof(Chip8, registers) + (x))
+#define OFFSET_I offsetof(Chip8, I)
+#define OFFSET_PC offsetof(Chip8, PC)
+#define OFFSET_DT offsetof(Chip8, DT)
+#define OFFSET_ST offsetof(Chip8, ST)
+
+// x86 register numbers used in ModRM
+#define AL 0
+#define CL 1
+
+// x86 opcodes for "op al, byte [mem]"
+#define X86_OR 0x0A
+#define X86_AND 0x22
+#define X86_XOR 0x32
+#define X86_ADD 0x02
+#define X86_SUB 0x2A
+#define X86_CMP 0x3A
+#define X86_JE 0x74
+#define X86_JNE 0x75
+#define X86_SETC 0x92
+#define X86_SETNC 0x93
+
+typedef void (*BlockFunction)(Chip8* chip);
+
+typedef enum {
+  BLOCK_EMPTY = 0, // not looked at yet
+  BLOCK_COMPILED, // native code available
+  BLOCK_INTERPRET // first instruction has no translation
+} BlockState;
+
+typedef struct {
+  BlockFunction code;
+  uint16_t start; // first byte of CHIP-8 code covered
+  uint16_t end; // one past the last byte covered
+  uint16_t length; // instructions executed by one run of the block
+  uint8_t state;
+} Block;
+
+typedef enum {
+  EMIT_UNSUPPORTED, // instruction must run in the interpreter, ends the block before it
+  EMIT_CONTINUE, // translated, block continues
+  EMIT_END, // translated control flow, ends the block after it
+  EMIT_SKIP // translated conditional skip, ends the block and depends on the next instruction
+} EmitResult;
+
+typedef struct {
+  uint8_t* p;
+} Emitter;
+
+struct Chip8Jit {
+  uint8_t* code; // executable memory, writable only while translate emits a block
+  size_t code_used;
+  Block blocks[DECODED_SIZE]; // Block starting at each address
+  uint16_t coverage[DECODED_SIZE]; // Number of blocks translated from each byte
+};
+
+static uint16_t fetch(Chip8* chip, uint16_t address);
+static Block* lookup(Chip8Jit* jit, Chip8* chip, uint16_t pc);
+static void translate(Chip8Jit* jit, Chip8* chip, uint16_t pc);
+static void interpret(Chip8Jit* jit, Chip8* chip);
+static void invalidate(Chip8Jit* jit, uint16_t address, uint16_t length);
+static void set_coverage(Chip8Jit* jit, Block* block, int delta);
+static int protect(Chip8Jit* jit, size_t offset, size_t size, int prot);
+static EmitResult emit_instruction(Emitter* e, uint16_t opcode, uint16_t next, uint16_t address, uint8_t quirks);
+static void emit_store_word(Emitter* e, uint32_t offset, uint16_t value);
+static void emit_ret(Emitter* e);
+
+
+Chip8Jit* chip8_jit_create(void) {
+  Chip8Jit* jit = malloc(sizeof(Chip8Jit));
+  if (!jit) {
+    return NULL;
+  }
+  // Never writable and executable at once
+  void* code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    free(jit);
+    return NULL;
+  }
+  if (mprotect(code, CODE_SIZE, PROT_READ | PROT_EXEC)) {
+    munmap(code, CODE_SIZE);
+    free(jit);
+    return NULL;
+  }
+  jit->code = code;
+  chip8_jit_flush(jit);
+  return jit;
+}
+
+void chip8_jit_destroy(Chip8Jit* jit) {
+  if (!jit) {
+    return;
+  }
+  munmap(jit->code, CODE_SIZE);
+  free(jit);
+}
+
+void chip8_jit_flush(Chip8Jit* jit) {
+  assert(jit);
+  jit->code_used = 0;
+  memset(jit->blocks, 0, sizeof(jit->blocks));
+  memset(jit->coverage, 0, sizeof(jit->coverage));
+}
+
+void chip8_jit_run(Chip8Jit* jit, Chip8* chip, long count) {
+  assert(jit);
+  assert(chip);
+
+  while (count > 0) {
+    Block* block = lookup(jit, chip, chip->PC);
+    // A block always runs to its end, near the end of the budget the
+    // remaining instructions are interpreted one by one
+    if (block && block->length <= count) {
+#ifdef CHIP8_PROFILE
+      // Blocks are straight line code, every instruction in one runs once
+      for (int i = 0; i < block->length; i++) {
+        uint16_t pc = chip->PC + 2 * i;
+        PROFILE_INSTRUCTION(pc, fetch(chip, pc));
+      }
+#endif
+      block->code(chip);
+      count -= block->length;
+    } else {
+      interpret(jit, chip);
+      count--;
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Static functions
+// ----------------------------------------------------------------------------
+
+static uint16_t fetch(Chip8* chip, uint16_t address) {
+  return (chip->memory[address] << 8) | chip->memory[(uint16_t)(address + 1)];
+}
+
+static Block* lookup(Chip8Jit* jit, Chip8* chip, uint16_t pc) {
+  if (pc >= DECODED_SIZE - 1) {
+    return NULL;
+  }
+  Block* block = &jit->blocks[pc];
+  if (block->state == BLOCK_EMPTY) {
+    translate(jit, chip, pc);
+  }
+  return (block->state == BLOCK_COMPILED) ? block : NULL;
+}
+
+static void translate(Chip8Jit* jit, Chip8* chip, uint16_t pc) {
+  if (CODE_SIZE - jit->code_used < MAX_BLOCK_BYTES) {
+    chip8_jit_flush(jit);
+  }
+
+  Block* block = &jit->blocks[pc];
+  uint8_t* code = jit->code + jit->code_used;
+  Emitter e = {code};
+  uint16_t address = pc;
+  int length = 0;
+  EmitResult result = EMIT_CONTINUE;
+  // Nothing is translated when the code can not be made writable
+  int writable = !protect(jit, jit->code_used, MAX_BLOCK_BYTES, PROT_READ | PROT_WRITE);
+
+  // The instruction after a skip must be inside the decoded range as well
+  while (writable && result == EMIT_CONTINUE && length < MAX_BLOCK_INSTRUCTIONS
+         && address + 4 <= DECODED_SIZE) {
+    result = emit_instruction(&e, fetch(chip, address), fetch(chip, address + 2), address, chip->quirks);
+    if (result != EMIT_UNSUPPORTED) {
+      address += 2;
+      length++;
+    }
+  }
+
+  if (length > 0 && result != EMIT_END && result != EMIT_SKIP) {
+    // Fell off the block, continue at the next instruction
+    emit_store_word(&e, OFFSET_PC, address);
+    emit_ret(&e);
+  }
+  if (writable && protect(jit, jit->code_used, MAX_BLOCK_BYTES, PROT_READ | PROT_EXEC)) {
+    // No block may run from the writable buffer, start over next time
+    chip8_jit_flush(jit);
+    length = 0;
+  }
+
+  block->start = pc;
+  if (length == 0) {
+    // Remember the miss so the instruction is not looked at again, it is
+    // still covered so a write can turn it into something translatable
+    block->state = BLOCK_INTERPRET;
+    block->end = pc + 2;
+    set_coverage(jit, block, 1);
+    return;
+  }
+
+  block->code = (BlockFunction)(void*)code;
+  block->end = address;
+  if (result == EMIT_SKIP) {
+    // The skip distance depends on whether the next instruction is F000
+    block->end = address + 2;
+  }
+  block->length = length;
+  block->state = BLOCK_COMPILED;
+  set_coverage(jit, block, 1);
+  jit->code_used += e.p - code;
+}
+
+static void interpret(Chip8Jit* jit, Chip8* chip) {
+  uint16_t pc = chip->PC;
+  uint16_t opcode = fetch(chip, pc);
+  uint16_t address = chip->I;
+  uint16_t length = 0;
+
+  // Stores into memory may overwrite translated code
+  if ((opcode & 0xF0FF) == 0xF033) {
+    length = 3;
+  } else if ((opcode & 0xF0FF) == 0xF055) {
+    length = ((opcode & 0x0F00) >> 8) + 1;
+  } else if ((opcode & 0xF00F) == 0x5002) {
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+    length = ((x <= y) ? y - x : x - y) + 1;
+  }
+
+  chip8_step(chip);
+  if (length) {
+    invalidate(jit, address, length);
+    // A store running past the end of memory continues at address 0
+    if (address + length > MEMORY_SIZE) {
+      invalidate(jit, 0, address + length - MEMORY_SIZE);
+    }
+  }
+}
+
+static void invalidate(Chip8Jit* jit, uint16_t address, uint16_t length) {
+  int end = address + length;
+  if (end > DECODED_SIZE) {
+    end = DECODED_SIZE;
+  }
+
+  int covered = 0;
+  for (int i = address; i < end; i++) {
+    covered |= jit->coverage[i];
+  }
+  if (!covered) {
+    return;
+  }
+
+  // Only blocks starting at most one block length before the write can
+  // overlap it, plus the 2 bytes a block ending in a skip reads past its end
+  int start = address - (MAX_BLOCK_INSTRUCTIONS * 2 + 2);
+  if (start < 0) {
+    start = 0;
+  }
+  for (int i = start; i < end; i++) {
+    Block* block = &jit->blocks[i];
+    if (block->state != BLOCK_EMPTY && block->start < end && block->end > address) {
+      set_coverage(jit, block, -1);
+      block->state = BLOCK_EMPTY;
+    }
+  }
+}
+
+static void set_coverage(Chip8Jit* jit, Block* block, int delta) {
+  for (int i = block->start; i < block->end; i++) {
+    jit->coverage[i] += delta;
+  }
+}
+
+// Changes the protection of the pages holding code[offset, offset + size)
+static int protect(Chip8Jit* jit, size_t offset, size_t size, int prot) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t start = offset / page * page;
+  return mprotect(jit->code + start, offset + size - start, prot);
+}
+
+// ----------------------------------------------------------------------------
+// Code generation
+// ----------------------------------------------------------------------------
+
+static void emit_byte(Emitter* e, uint8_t value) {
+  *e->p++ = value;
+}
+
+static void emit_word(Emitter* e, uint16_t value) {
+  emit_byte(e, value & 0xFF);
+  emit_byte(e, value >> 8);
+}
+
+// ModRM for [rdi + disp32] with the given reg field
+static void emit_operand(Emitter* e, uint8_t reg, uint32_t offset) {
+  emit_byte(e, 0x80 | (reg << 3) | 0x7);
+  emit_byte(e, offset & 0xFF);
+  emit_byte(e, (offset >> 8) & 0xFF);
+  emit_byte(e, (offset >> 16) & 0xFF);
+  emit_byte(e, offset >> 24);
+}
+
+static void emit_load_al(Emitter* e, uint32_t offset) {
+  emit_byte(e, 0x8A); // mov al, byte [mem]
+  emit_operand(e, AL, offset);
+}
+
+static void emit_store(Emitter* e, uint8_t reg, uint32_t offset) {
+  emit_byte(e, 0x88); // mov byte [mem], reg
+  emit_operand(e, reg, offset);
+}
+
+static void emit_alu_al(Emitter* e, uint8_t op, uint32_t offset) {
+  emit_byte(e, op); // op al, byte [mem]
+  emit_operand(e, AL, offset);
+}
+
+static void emit_store_byte(Emitter* e, uint32_t offset, uint8_t value) {
+  emit_byte(e, 0xC6); // mov byte [mem], imm8
+  emit_operand(e, 0, offset);
+  emit_byte(e, value);
+}
+
+static void emit_store_word(Emitter* e, uint32_t offset, uint16_t value) {
+  emit_byte(e, 0x66); // mov word [mem], imm16
+  emit_byte(e, 0xC7);
+  emit_operand(e, 0, offset);
+  emit_word(e, value);
+}
+
+static void emit_setcc_flag(Emitter* e, uint8_t cc) {
+  emit_byte(e, 0x0F); // setcc cl
+  emit_byte(e, cc);
+  emit_byte(e, 0xC1);
+}
+
+static void emit_movzx_eax(Emitter* e, uint32_t offset) {
+  emit_byte(e, 0x0F); // movzx eax, byte [mem]
+  emit_byte(e, 0xB6);
+  emit_operand(e, AL, offset);
+}
+
+static void emit_ret(Emitter* e) {
+  emit_byte(e, 0xC3);
+}
+
+// Expects the flags of a compare, skips the next instruction unless jcc is
+// taken. The skipped instruction is four bytes long when it is F000 nnnn.
+static void emit_skip(Emitter* e, uint8_t jcc, uint16_t next_opcode, uint16_t address) {
+  uint16_t next = address + 2;
+  emit_store_word(e, OFFSET_PC, next); // mov does not touch flags
+  emit_byte(e, jcc);
+  emit_byte(e, 9); // length of the store below
+  emit_store_word(e, OFFSET_PC, next + ((next_opcode == 0xF000) ? 4 : 2));
+  emit_ret(e);
+}
+
+// 8xyN with the result in al and the flag in cl
+static void emit_store_result_and_flag(Emitter* e, uint8_t x) {
+  emit_store(e, AL, OFFSET_REGISTER(x));
+  emit_store(e, CL, OFFSET_REGISTER(0xF));
+}
+
+static EmitResult emit_compare(Emitter* e, uint8_t x, uint8_t y, uint8_t n, uint8_t quirks) {
+  switch (n) {
+    case 0x00: // 8xy0 - LD Vx, Vy
+      emit_load_al(e, OFFSET_REGISTER(y));
+      emit_store(e, AL, OFFSET_REGISTER(x));
+      break;
+    case 0x01: // 8xy1 - OR Vx, Vy
+    case 0x02: // 8xy2 - AND Vx, Vy
+    case 0x03: // 8xy3 - XOR Vx, Vy
+      emit_load_al(e, OFFSET_REGISTER(x));
+      emit_alu_al(e, (n == 0x01) ? X86_OR : (n == 0x02) ? X86_AND : X86_XOR, OFFSET_REGISTER(y));
+      emit_store(e, AL, OFFSET_REGISTER(x));
+      if (!(quirks & CHIP8_QUIRK_KEEP_VF)) {
+        emit_store_byte(e, OFFSET_REGISTER(0xF), 0);
+      }
+      break;
+    case 0x04: // 8xy4 - ADD Vx, Vy, VF is the carry
+      emit_load_al(e, OFFSET_REGISTER(x));
+      emit_alu_al(e, X86_ADD, OFFSET_REGISTER(y));
+      emit_setcc_flag(e, X86_SETC);
+      emit_store_result_and_flag(e, x);
+      break;
+    case 0x05: // 8xy5 - SUB Vx, Vy, VF is NOT borrow
+      emit_load_al(e, OFFSET_REGISTER(x));
+      emit_alu_al(e, X86_SUB, OFFSET_REGISTER(y));
+      emit_setcc_flag(e, X86_SETNC);
+      emit_store_result_and_flag(e, x);
+      break;
+    case 0x06: // 8xy6 - SHR Vx {, Vy}, shifted out bit lands in CF
+      emit_load_al(e, OFFSET_REGISTER((quirks & CHIP8_QUIRK_SHIFT) ? x : y));
+      emit_byte(e, 0xD0); // shr al, 1
+      emit_byte(e, 0xE8);
+      emit_setcc_flag(e, X86_SETC);
+      emit_store_result_and_flag(e, x);
+      break;
+    case 0x07: // 8xy7 - SUBN Vx, Vy
+      emit_load_al(e, OFFSET_REGISTER(y));
+      emit_alu_al(e, X86_SUB, OFFSET_REGISTER(x));
+      emit_setcc_flag(e, X86_SETNC);
+      emit_store_result_and_flag(e, x);
+      break;
+    case 0x0E: // 8xyE - SHL Vx {, Vy}
+      emit_load_al(e, OFFSET_REGISTER((quirks & CHIP8_QUIRK_SHIFT) ? x : y));
+      emit_byte(e, 0xD0); // shl al, 1
+      emit_byte(e, 0xE0);
+      emit_setcc_flag(e, X86_SETC);
+      emit_store_result_and_flag(e, x);
+      break;
+    default:
+      return EMIT_UNSUPPORTED;
+  }
+  return EMIT_CONTINUE;
+}
+
+static EmitResult emit_f_branch(Emitter* e, uint8_t x, uint8_t kk) {
+  switch (kk) {
+    case 0x07: // Fx07 - LD Vx, DT
+      emit_load_al(e, OFFSET_DT);
+      emit_store(e, AL, OFFSET_REGISTER(x));
+      break;
+    case 0x15: // Fx15 - LD DT, Vx
+      emit_load_al(e, OFFSET_REGISTER(x));
+      emit_store(e, AL, OFFSET_DT);
+      break;
+    case 0x18: // Fx18 - LD ST, Vx
+      emit_load_al(e, OFFSET_REGISTER(x));
+      emit_store(e, AL, OFFSET_ST);
+      break;
+    case 0x1E: // Fx1E - ADD I, Vx
+      emit_movzx_eax(e, OFFSET_REGISTER(x));
+      emit_byte(e, 0x66); // add word [I], ax
+      emit_byte(e, 0x01);
+      emit_operand(e, AL, OFFSET_I);
+      break;
+    case 0x29: // Fx29 - LD F, Vx
+      emit_movzx_eax(e, OFFSET_REGISTER(x));
+      emit_byte(e, 0x8D); // lea eax, [rax + rax * 4]
+      emit_byte(e, 0x04);
+      emit_byte(e, 0x80);
+      emit_byte(e, 0x66); // mov word [I], ax
+      emit_byte(e, 0x89);
+      emit_operand(e, AL, OFFSET_I);
+      break;
+    default:
+      return EMIT_UNSUPPORTED;
+  }
+  return EMIT_CONTINUE;
+}
+
+static EmitResult emit_instruction(Emitter* e, uint16_t opcode, uint16_t next, uint16_t address, uint8_t quirks) {
+  uint8_t x = (uint8_t)((opcode & 0x0F00) >> 8);
+  uint8_t y = (uint8_t)((opcode & 0x00F0) >> 4);
+  uint8_t kk = (uint8_t)(opcode & 0x00FF);
+  uint8_t n = (uint8_t)(opcode & 0x000F);
+  uint16_t nnn = opcode & 0x0FFF;
+
+  switch (opcode & 0xF000) {
+    case 0x1000: // 1nnn - JP addr
+      emit_store_word(e, OFFSET_PC, nnn);
+      emit_ret(e);
+      return EMIT_END;
+    case 0x3000: // 3xkk - SE Vx, byte
+      emit_byte(e, 0x80); // cmp byte [Vx], kk
+      emit_operand(e, 7, OFFSET_REGISTER(x));
+      emit_byte(e, kk);
+      emit_skip(e, X86_JNE, next, address);
+      return EMIT_SKIP;
+    case 0x4000: // 4xkk - SNE Vx, byte
+      emit_byte(e, 0x80); // cmp byte [Vx], kk
+      emit_operand(e, 7, OFFSET_REGISTER(x));
+      emit_byte(e, kk);
+      emit_skip(e, X86_JE, next, address);
+      return EMIT_SKIP;
+    case 0x5000: // 5xy0 - SE Vx, Vy
+      if (n == 0x2 || n == 0x3) {
+        return EMIT_UNSUPPORTED; // XO-CHIP register range load and store
+      }
+      emit_load_al(e, OFFSET_REGISTER(x));
+      emit_alu_al(e, X86_CMP, OFFSET_REGISTER(y));
+      emit_skip(e, X86_JNE, next, address);
+      return EMIT_SKIP;
+    case 0x6000: // 6xkk - LD Vx, byte
+      emit_store_byte(e, OFFSET_REGISTER(x), kk);
+      return EMIT_CONTINUE;
+    case 0x7000: // 7xkk - ADD Vx, byte
+      emit_byte(e, 0x80); // add byte [Vx], kk
+      emit_operand(e, 0, OFFSET_REGISTER(x));
+#ifdef CHIP8_JIT_FAULT
+      kk++; // wrong on purpose, make test checks -b validate catches it
+#endif
+      emit_byte(e, kk);
+      return EMIT_CONTINUE;
+    case 0x8000:
+      return emit_compare(e, x, y, n, quirks);
+    case 0x9000: // 9xy0 - SNE Vx, Vy
+      emit_load_al(e, OFFSET_REGISTER(x));
+      emit_alu_al(e, X86_CMP, OFFSET_REGISTER(y));
+      emit_skip(e, X86_JE, next, address);
+      return EMIT_SKIP;
+    case 0xA000: // Annn - LD I, addr
+      emit_store_word(e, OFFSET_I, nnn);
+      return EMIT_CONTINUE;
+    case 0xF000:
+      return emit_f_branch(e, x, kk);
+    default:
+      // CLS/RET/CALL/scrolls/Bnnn/RND/DRW/keys go through the interpreter
+      return EMIT_UNSUPPORTED;
+  }
+}
+
+#else
+
+// No code generator for this host, callers keep using chip8_step
+
+Chip8Jit* chip8_jit_create(void) {
+  return NULL;
+}
+
+void chip8_jit_destroy(Chip8Jit* jit) {
+  (void)jit;
+}
+
+void chip8_jit_flush(Chip8Jit* jit) {
+  (void)jit;
+}
+
+void chip8_jit_run(Chip8Jit* jit, Chip8* chip, long count) {
+  (void)jit;
+  while (count-- > 0) {
+    chip8_step(chip);
+  }
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "chip8.h"
+
+// Translates straight-line runs of CHIP-8 instructions into x86-64 code.
+// Instructions without a native translation (DRW, Fx0A, CALL/RET, memory
+// stores...) are executed through chip8_step.
+typedef struct Chip8Jit Chip8Jit;
+
+// Returns NULL when the host can not run translated code
+Chip8Jit* chip8_jit_create(void);
+void chip8_jit_destroy(Chip8Jit* jit);
+// Drops every translated block, needed after writing chip memory directly
+// or changing its quirks
+void chip8_jit_flush(Chip8Jit* jit);
+// Executes exactly count instructions, same result as count chip8_step calls
+void chip8_jit_run(Chip8Jit* jit, Chip8* chip, long count);
+
+#endif
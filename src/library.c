@@ -0,0 +1,533 @@
+#define _POSIX_C_SOURCE 200809L // Needed for mmap
+
+#include "library.h"
+#include "chip8.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_CODE_SIZE (4096 - PROGRAM_START_ADDRESS) // largest CHIP-8 and SCHIP program
+#define INITIAL_CAPACITY 64
+#define FILENAME_SIZE 4096
+#define LINE_SIZE 256
+
+// ustar header fields
+#define TAR_BLOCK_SIZE 512
+#define TAR_NAME 0
+#define TAR_NAME_SIZE 100
+#define TAR_FILE_SIZE 124
+#define TAR_TYPE 156
+#define TAR_MAGIC 257
+#define TAR_PREFIX 345
+#define TAR_PREFIX_SIZE 155
+
+typedef struct {
+  const char* name;
+  uint8_t quirks;
+  long ipf;
+} Profile;
+
+typedef enum {
+  PROFILE_CHIP8,
+  PROFILE_SCHIP,
+  PROFILE_XOCHIP,
+  PROFILE_COUNT
+} ProfileIndex;
+
+static const Profile PROFILES[PROFILE_COUNT] = {
+  // COSMAC VIP, the behaviour without quirks
+  [PROFILE_CHIP8] = {"chip8", 0, CHIP8_DEFAULT_IPF},
+  // SCHIP 1.1 on the HP 48
+  [PROFILE_SCHIP] = {"schip", CHIP8_QUIRK_SHIFT | CHIP8_QUIRK_KEEP_VF | CHIP8_QUIRK_KEEP_I
+                     | CHIP8_QUIRK_JUMP, 30},
+  // XO-CHIP as run by Octo
+  [PROFILE_XOCHIP] = {"xochip", CHIP8_QUIRK_WRAP | CHIP8_QUIRK_KEEP_VF, 1000}
+};
+
+typedef struct {
+  uint8_t sha1[LIBRARY_SHA1_SIZE];
+  const Profile* profile;
+  long ipf;
+} DatabaseEntry;
+
+struct Library {
+  LibraryRom* roms;
+  long count;
+  long capacity;
+  uint8_t* archive; // whole tar file, NULL when every ROM is mapped on its own
+  size_t archive_size;
+  DatabaseEntry* database; // sorted by hash
+  long database_count;
+  long ignored_lines; // database lines that could not be parsed
+};
+
+static int open_directory(Library* library, const char* path);
+static int open_archive(Library* library);
+static uint8_t* map_file(const char* filename, size_t* size);
+static int add_rom(Library* library, const char* name, const uint8_t* data, size_t size);
+static int load_database(Library* library, const uint8_t* text, size_t size);
+static const Profile* find_profile(const char* name);
+static const Profile* detect_profile(const uint8_t* data, size_t size);
+static int parse_sha1(const char* hex, uint8_t sha1[LIBRARY_SHA1_SIZE]);
+static size_t parse_octal(const uint8_t* field, int length);
+static int compare_entries(const void* a, const void* b);
+static int compare_roms(const void* a, const void* b);
+static void sha1_block(uint32_t state[5], const uint8_t* block);
+static uint32_t rotate_left(uint32_t value, int n);
+
+
+Library* library_open(const char* path) {
+  assert(path);
+
+  Library* library = calloc(1, sizeof(Library));
+  if (!library) {
+    return NULL;
+  }
+  struct stat st;
+  int failed = stat(path, &st) != 0;
+  if (!failed && S_ISDIR(st.st_mode)) {
+    failed = open_directory(library, path);
+  } else if (!failed) {
+    size_t size;
+    uint8_t* data = map_file(path, &size);
+    if (!data) {
+      failed = 1;
+    } else if (size >= TAR_BLOCK_SIZE && !memcmp(data + TAR_MAGIC, "ustar", 5)) {
+      library->archive = data;
+      library->archive_size = size;
+      failed = open_archive(library);
+    } else {
+      const char* name = strrchr(path, '/');
+      if (add_rom(library, name ? name + 1 : path, data, size)) {
+        munmap(data, size);
+        failed = 1;
+      }
+    }
+  }
+  if (failed || !library->count) {
+    library_close(library);
+    return NULL;
+  }
+
+  for (long i = 0; i < library->count; i++) {
+    LibraryRom* rom = &library->roms[i];
+    DatabaseEntry key;
+    memcpy(key.sha1, rom->sha1, LIBRARY_SHA1_SIZE);
+    const DatabaseEntry* entry = library->database_count
+        ? bsearch(&key, library->database, library->database_count, sizeof(DatabaseEntry), compare_entries)
+        : NULL;
+    const Profile* profile = entry ? entry->profile : detect_profile(rom->data, rom->size);
+    rom->platform = profile->name;
+    rom->known = entry != NULL;
+    rom->quirks = profile->quirks;
+    rom->ipf = entry ? entry->ipf : profile->ipf;
+  }
+  return library;
+}
+
+void library_close(Library* library) {
+  if (!library) {
+    return;
+  }
+  for (long i = 0; i < library->count; i++) {
+    if (!library->archive) {
+      munmap((void*)library->roms[i].data, library->roms[i].size);
+    }
+    free((void*)library->roms[i].name);
+  }
+  if (library->archive) {
+    munmap(library->archive, library->archive_size);
+  }
+  free(library->roms);
+  free(library->database);
+  free(library);
+}
+
+long library_count(const Library* library) {
+  assert(library);
+  return library->count;
+}
+
+const LibraryRom* library_rom(const Library* library, long index) {
+  assert(library);
+  assert(index >= 0 && index < library->count);
+  return &library->roms[index];
+}
+
+long library_ignored_lines(const Library* library) {
+  assert(library);
+  return library->ignored_lines;
+}
+
+void library_sha1(const uint8_t* data, size_t size, uint8_t digest[LIBRARY_SHA1_SIZE]) {
+  assert(data || !size);
+  assert(digest);
+
+  uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  size_t offset = 0;
+  for (; offset + 64 <= size; offset += 64) {
+    sha1_block(state, data + offset);
+  }
+
+  // Padding: a one bit, zeros, then the message length in bits
+  uint8_t tail[128] = {0};
+  size_t left = size - offset;
+  if (left) {
+    memcpy(tail, data + offset, left);
+  }
+  tail[left] = 0x80;
+  size_t tail_size = (left < 56) ? 64 : 128;
+  uint64_t bits = (uint64_t)size * 8;
+  for (int i = 0; i < 8; i++) {
+    tail[tail_size - 1 - i] = (bits >> (8 * i)) & 0xFF;
+  }
+  for (size_t i = 0; i < tail_size; i += 64) {
+    sha1_block(state, tail + i);
+  }
+
+  for (int i = 0; i < 5; i++) {
+    digest[4 * i] = state[i] >> 24;
+    digest[4 * i + 1] = (state[i] >> 16) & 0xFF;
+    digest[4 * i + 2] = (state[i] >> 8) & 0xFF;
+    digest[4 * i + 3] = state[i] & 0xFF;
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Static functions
+// ----------------------------------------------------------------------------
+
+static int open_directory(Library* library, const char* path) {
+  DIR* dir = opendir(path);
+  if (!dir) {
+    return 1;
+  }
+  int failed = 0;
+  struct dirent* entry;
+  while (!failed && (entry = readdir(dir))) {
+    // Hidden files, "." and ".." are left out
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    char filename[FILENAME_SIZE];
+    if (snprintf(filename, sizeof(filename), "%s/%s", path, entry->d_name) >= FILENAME_SIZE) {
+      continue;
+    }
+    struct stat st;
+    if (stat(filename, &st) || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    size_t size;
+    uint8_t* data = map_file(filename, &size);
+    if (!data) {
+      continue;
+    }
+    if (!strcmp(entry->d_name, LIBRARY_DATABASE)) {
+      failed = load_database(library, data, size);
+      munmap(data, size);
+    } else if (add_rom(library, entry->d_name, data, size)) {
+      munmap(data, size);
+      failed = 1;
+    }
+  }
+  closedir(dir);
+
+  // readdir order depends on the file system, runs should not
+  qsort(library->roms, library->count, sizeof(LibraryRom), compare_roms);
+  return failed;
+}
+
+static int open_archive(Library* library) {
+  const uint8_t* data = library->archive;
+  size_t size = library->archive_size;
+  size_t offset = 0;
+
+  // Blocks of 512 bytes, a header then the contents of each member. The
+  // archive ends with zero blocks.
+  while (size - offset >= TAR_BLOCK_SIZE && data[offset]) {
+    const uint8_t* header = data + offset;
+    size_t length = parse_octal(header + TAR_FILE_SIZE, 12);
+    offset += TAR_BLOCK_SIZE;
+    if (length > size - offset) {
+      return 1;
+    }
+
+    // Regular files only, directories and links have nothing to run
+    if ((header[TAR_TYPE] == '0' || header[TAR_TYPE] == 0) && length) {
+      char name[TAR_PREFIX_SIZE + 1 + TAR_NAME_SIZE + 1];
+      const char* prefix = (const char*)header + TAR_PREFIX;
+      if (prefix[0]) {
+        snprintf(name, sizeof(name), "%.155s/%.100s", prefix, (const char*)header + TAR_NAME);
+      } else {
+        snprintf(name, sizeof(name), "%.100s", (const char*)header + TAR_NAME);
+      }
+      const char* base = strrchr(name, '/');
+      base = base ? base + 1 : name;
+      if (!strcmp(base, LIBRARY_DATABASE)) {
+        if (load_database(library, data + offset, length)) {
+          return 1;
+        }
+      } else if (base[0] != '.' && add_rom(library, name, data + offset, length)) {
+        return 1;
+      }
+    }
+    offset += (length + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+  }
+  return 0;
+}
+
+static uint8_t* map_file(const char* filename, size_t* size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  // Empty files can not be mapped and hold no ROM anyway
+  if (fstat(fd, &st) || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  *size = st.st_size;
+  void* data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return (data == MAP_FAILED) ? NULL : data;
+}
+
+static int add_rom(Library* library, const char* name, const uint8_t* data, size_t size) {
+  if (library->count == library->capacity) {
+    long capacity = library->capacity ? 2 * library->capacity : INITIAL_CAPACITY;
+    LibraryRom* grown = realloc(library->roms, capacity * sizeof(LibraryRom));
+    if (!grown) {
+      return 1;
+    }
+    library->roms = grown;
+    library->capacity = capacity;
+  }
+  size_t length = strlen(name) + 1;
+  char* copy = malloc(length);
+  if (!copy) {
+    return 1;
+  }
+  memcpy(copy, name, length);
+
+  LibraryRom* rom = &library->roms[library->count++];
+  rom->name = copy;
+  rom->data = data;
+  rom->size = size;
+  library_sha1(data, size, rom->sha1);
+  return 0;
+}
+
+static int load_database(Library* library, const uint8_t* text, size_t size) {
+  long capacity = library->database_count;
+  size_t start = 0;
+  while (start < size) {
+    size_t end = start;
+    while (end < size && text[end] != '\n') {
+      end++;
+    }
+    char line[LINE_SIZE];
+    size_t length = (end - start < LINE_SIZE - 1) ? end - start : LINE_SIZE - 1;
+    memcpy(line, text + start, length);
+    line[length] = '\0';
+    start = end + 1;
+
+    char hash[2 * LIBRARY_SHA1_SIZE + 1];
+    char platform[16];
+    long ipf = 0;
+    int fields = sscanf(line, "%40s %15s %ld", hash, platform, &ipf);
+    if (fields < 1 || hash[0] == '#') {
+      continue;
+    }
+    DatabaseEntry entry;
+    entry.profile = (fields >= 2) ? find_profile(platform) : NULL;
+    if (!entry.profile || parse_sha1(hash, entry.sha1)) {
+      library->ignored_lines++;
+      continue;
+    }
+    entry.ipf = (fields == 3 && ipf > 0) ? ipf : entry.profile->ipf;
+
+    if (library->database_count == capacity) {
+      capacity = capacity ? 2 * capacity : INITIAL_CAPACITY;
+      DatabaseEntry* grown = realloc(library->database, capacity * sizeof(DatabaseEntry));
+      if (!grown) {
+        return 1;
+      }
+      library->database = grown;
+    }
+    library->database[library->database_count++] = entry;
+  }
+  qsort(library->database, library->database_count, sizeof(DatabaseEntry), compare_entries);
+  return 0;
+}
+
+static const Profile* find_profile(const char* name) {
+  for (int i = 0; i < PROFILE_COUNT; i++) {
+    if (!strcmp(PROFILES[i].name, name)) {
+      return &PROFILES[i];
+    }
+  }
+  return NULL;
+}
+
+static const Profile* detect_profile(const uint8_t* data, size_t size) {
+  // Only XO-CHIP can address more than 4KB
+  if (size > MAX_CODE_SIZE) {
+    return &PROFILES[PROFILE_XOCHIP];
+  }
+
+  // Instructions are found by following the code reachable from the start,
+  // sprite data elsewhere in the ROM would look like random opcodes. Jumps
+  // through Bnnn can not be followed.
+  uint8_t visited[MAX_CODE_SIZE] = {0};
+  uint16_t pending[MAX_CODE_SIZE];
+  int count = 0;
+  int schip = 0;
+  pending[count++] = 0;
+  visited[0] = 1;
+  while (count) {
+    size_t offset = pending[--count];
+    if (offset + 2 > size) {
+      continue;
+    }
+    uint16_t opcode = (data[offset] << 8) | data[offset + 1];
+    uint16_t next = (offset + 4 <= size) ? (data[offset + 2] << 8) | data[offset + 3] : 0;
+    uint16_t address = PROGRAM_START_ADDRESS + offset;
+    uint16_t targets[2] = {address + 2, 0};
+
+    if (opcode == 0xF000 || opcode == 0xF002 || (opcode & 0xF00E) == 0x5002
+        || (opcode & 0xF0FF) == 0xF001 || (opcode & 0xF0FF) == 0xF03A) {
+      return &PROFILES[PROFILE_XOCHIP];
+    }
+    if ((opcode & 0xFFF0) == 0x00C0 || (opcode >= 0x00FB && opcode <= 0x00FF)
+        || (opcode & 0xF0FF) == 0xF030 || (opcode & 0xF0FF) == 0xF075 || (opcode & 0xF0FF) == 0xF085) {
+      schip = 1;
+    }
+
+    switch (opcode & 0xF000) {
+      case 0x0000:
+        if (opcode == 0x00EE || opcode == 0x00FD) {
+          targets[0] = 0;
+        }
+        break;
+      case 0x1000:
+        targets[0] = opcode & 0x0FFF;
+        break;
+      case 0x2000:
+        targets[1] = opcode & 0x0FFF;
+        break;
+      case 0xB000:
+        targets[0] = 0;
+        break;
+      case 0x3000:
+      case 0x4000:
+      case 0x5000:
+      case 0x9000:
+      case 0xE000:
+        // Both sides of a skip, F000 is four bytes long
+        targets[1] = address + ((next == 0xF000) ? 6 : 4);
+        break;
+    }
+    for (int i = 0; i < 2; i++) {
+      size_t target = targets[i] - PROGRAM_START_ADDRESS;
+      if (targets[i] >= PROGRAM_START_ADDRESS && target < size && !visited[target]) {
+        visited[target] = 1;
+        pending[count++] = target;
+      }
+    }
+  }
+  return &PROFILES[schip ? PROFILE_SCHIP : PROFILE_CHIP8];
+}
+
+static int parse_sha1(const char* hex, uint8_t sha1[LIBRARY_SHA1_SIZE]) {
+  if (strlen(hex) != 2 * LIBRARY_SHA1_SIZE) {
+    return 1;
+  }
+  for (int i = 0; i < 2 * LIBRARY_SHA1_SIZE; i++) {
+    char c = hex[i];
+    int digit;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      digit = c - 'A' + 10;
+    } else {
+      return 1;
+    }
+    if (i % 2 == 0) {
+      sha1[i / 2] = digit << 4;
+    } else {
+      sha1[i / 2] |= digit;
+    }
+  }
+  return 0;
+}
+
+static size_t parse_octal(const uint8_t* field, int length) {
+  size_t value = 0;
+  for (int i = 0; i < length && field[i] >= '0' && field[i] <= '7'; i++) {
+    value = value * 8 + (field[i] - '0');
+  }
+  return value;
+}
+
+static int compare_entries(const void* a, const void* b) {
+  return memcmp(((const DatabaseEntry*)a)->sha1, ((const DatabaseEntry*)b)->sha1, LIBRARY_SHA1_SIZE);
+}
+
+static int compare_roms(const void* a, const void* b) {
+  return strcmp(((const LibraryRom*)a)->name, ((const LibraryRom*)b)->name);
+}
+
+static void sha1_block(uint32_t state[5], const uint8_t* block) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16)
+           | ((uint32_t)block[4 * i + 2] << 8) | block[4 * i + 3];
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    uint32_t temp = rotate_left(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotate_left(b, 30);
+    b = a;
+    a = temp;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+static uint32_t rotate_left(uint32_t value, int n) {
+  return (value << n) | (value >> (32 - n));
+}
@@ -0,0 +1,46 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ROM library, every ROM of a directory or of an uncompressed tar archive
+// mapped read only and identified by the SHA-1 of its contents. Each ROM
+// gets the quirks and instructions per frame of its platform profile.
+//
+// The profile comes from the library database when the hash is listed in
+// it, otherwise it is guessed from the instructions the ROM contains. The
+// database is a text file named LIBRARY_DATABASE inside the directory or
+// archive, one ROM per line:
+//
+//   <sha1 in hex> <chip8|schip|xochip> [instructions per frame]
+//
+// Blank lines and lines starting with # are ignored.
+#define LIBRARY_DATABASE "quirks.txt"
+#define LIBRARY_SHA1_SIZE 20
+
+typedef struct {
+  const char* name; // file name, path inside the archive for tar files
+  const uint8_t* data; // ROM image, points into the mapping
+  size_t size;
+  uint8_t sha1[LIBRARY_SHA1_SIZE];
+  const char* platform; // profile the settings come from
+  int known; // listed in the database rather than guessed
+  uint8_t quirks; // CHIP8_QUIRK_* flags to run it with
+  long ipf; // recommended instructions per frame
+} LibraryRom;
+
+typedef struct Library Library;
+
+// path is a directory, a tar archive or a single ROM, returns NULL when it
+// can not be read or holds no ROM
+Library* library_open(const char* path);
+void library_close(Library* library);
+long library_count(const Library* library);
+const LibraryRom* library_rom(const Library* library, long index);
+// Lines of the database with an unknown platform or a malformed hash, the
+// ROMs they name are detected instead
+long library_ignored_lines(const Library* library);
+void library_sha1(const uint8_t* data, size_t size, uint8_t digest[LIBRARY_SHA1_SIZE]);
+
+#endif
@@ -0,0 +1,543 @@
+#define _POSIX_C_SOURCE 200809L // Needed for posix_memalign
+
+#include "lockstep.h"
+#include "chip8.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LANES 16 // instances per block, one SSE register of bytes
+#define CHUNK_SIZE 0xFFFF // most instructions a 16-bit lane budget holds
+#define DIVERGED_ROUNDS 4 // rounds per instruction after which the lanes count as diverged
+#define MAX_BACKOFF 64 // most frames run scalar before lockstep is tried again
+// Vector lane steps that pay for running a lane scalar in the middle of a
+// round, its Chip8 is out of cache unlike on the scalar path
+#define VISIT_COST 8
+
+// Lane vectors, GCC splits them into SSE2 operations or uses AVX2 when the
+// CPU has it
+typedef uint8_t Bytes __attribute__((vector_size(LANES)));
+typedef uint16_t Words __attribute__((vector_size(2 * LANES)));
+typedef int16_t SignedWords __attribute__((vector_size(2 * LANES)));
+
+// Picks mask lanes of a, the other lanes of b
+#define SELECT(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+// The round loop is built once per instruction set and picked at load time,
+// the helpers it calls are inlined so they run with its instruction set
+#if defined(__x86_64__) && defined(__linux__)
+#define LOCKSTEP_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define LOCKSTEP_TARGETS
+#endif
+#define ROUND_HELPER static inline __attribute__((always_inline))
+
+typedef struct {
+  Bytes V[REGISTERS_SIZE];
+  Bytes DT;
+  Bytes ST;
+  Words I;
+  Words PC;
+  Words remaining; // instructions left in the chunk, always 0 on padding lanes
+  Words used; // all ones on lanes holding an instance
+} Block;
+
+// Instruction every lane at an address executes the same way
+typedef struct {
+  uint16_t opcode;
+  uint16_t skip; // bytes a taken skip moves the PC past the next instruction
+} VectorOp;
+
+struct Chip8Lockstep {
+  int count;
+  int block_count;
+  Block* blocks; // registers, I, PC and timers of every lane
+  Chip8* chips; // the rest of every lane, registers only while it runs scalar
+  uint8_t quirks;
+  int scalar_frames; // frames left before lockstep is tried again
+  int backoff; // scalar frames after the next divergence
+  long vector_steps;
+  long scalar_steps;
+  uint8_t image[MEMORY_SIZE]; // memory of the prototype, opcodes are fetched here
+  uint8_t written[MEMORY_SIZE / 8]; // bit set once any lane stored to the byte
+};
+
+static int run_lockstep(Chip8Lockstep* lockstep, long ipf);
+static int run_rounds(Chip8Lockstep* lockstep, long limit);
+static void run_scalar(Chip8Lockstep* lockstep, long extra);
+ROUND_HELPER int vector_op(const Chip8Lockstep* lockstep, uint16_t pc, VectorOp* op);
+ROUND_HELPER void execute(Block* block, const VectorOp* op, uint8_t quirks, uint16_t pc, const Words* mask);
+static void run_lane(Chip8Lockstep* lockstep, int lane);
+static void mark_stores(Chip8Lockstep* lockstep, const Chip8* chip);
+static void lane_to_chip(Chip8Lockstep* lockstep, int lane);
+static void chip_to_lane(Chip8Lockstep* lockstep, int lane);
+static void mark_written(Chip8Lockstep* lockstep, uint16_t address, int length);
+ROUND_HELPER int was_written(const Chip8Lockstep* lockstep, uint16_t address, int length);
+ROUND_HELPER int lowest_pc(const Words* lowest, const Words* pending, uint16_t* pc);
+ROUND_HELPER int lane_count(const Words* mask);
+
+
+Chip8Lockstep* chip8_lockstep_create(int count, const Chip8* prototype, uint64_t seed) {
+  assert(count > 0);
+  assert(prototype);
+
+  Chip8Lockstep* lockstep = calloc(1, sizeof(Chip8Lockstep));
+  if (!lockstep) {
+    return NULL;
+  }
+  lockstep->count = count;
+  lockstep->block_count = (count + LANES - 1) / LANES;
+  void* blocks = NULL;
+  // Words need 32-byte alignment, more than malloc promises
+  if (posix_memalign(&blocks, 64, lockstep->block_count * sizeof(Block))) {
+    blocks = NULL;
+  }
+  lockstep->blocks = blocks;
+  lockstep->chips = malloc(count * sizeof(Chip8));
+  if (!lockstep->blocks || !lockstep->chips) {
+    chip8_lockstep_destroy(lockstep);
+    return NULL;
+  }
+  memset(lockstep->blocks, 0, lockstep->block_count * sizeof(Block));
+  memcpy(lockstep->image, prototype->memory, MEMORY_SIZE);
+  lockstep->quirks = prototype->quirks;
+  lockstep->backoff = 1;
+
+  for (int i = 0; i < count; i++) {
+    memcpy(&lockstep->chips[i], prototype, sizeof(Chip8));
+    chip8_seed(&lockstep->chips[i], seed + i);
+    chip_to_lane(lockstep, i);
+    lockstep->blocks[i / LANES].used[i % LANES] = 0xFFFF;
+  }
+  return lockstep;
+}
+
+void chip8_lockstep_destroy(Chip8Lockstep* lockstep) {
+  if (!lockstep) {
+    return;
+  }
+  free(lockstep->blocks);
+  free(lockstep->chips);
+  free(lockstep);
+}
+
+int chip8_lockstep_count(const Chip8Lockstep* lockstep) {
+  assert(lockstep);
+  return lockstep->count;
+}
+
+Chip8* chip8_lockstep_instance(Chip8Lockstep* lockstep, int index) {
+  assert(lockstep);
+  assert(index >= 0 && index < lockstep->count);
+  lane_to_chip(lockstep, index);
+  return &lockstep->chips[index];
+}
+
+void chip8_lockstep_set_keys(Chip8Lockstep* lockstep, int index, uint16_t keys) {
+  assert(lockstep);
+  assert(index >= 0 && index < lockstep->count);
+  lockstep->chips[index].keys = keys;
+}
+
+void chip8_lockstep_run(Chip8Lockstep* lockstep, long ipf, long frames) {
+  assert(lockstep);
+  assert(ipf >= 0);
+  assert(frames >= 0);
+
+  for (long frame = 0; frame < frames; frame++) {
+    if (lockstep->scalar_frames > 0) {
+      lockstep->scalar_frames--;
+      run_scalar(lockstep, ipf);
+    } else if (run_lockstep(lockstep, ipf)) {
+      lockstep->backoff = 1;
+    } else {
+      // Lanes that parted rarely meet again soon, back off exponentially
+      lockstep->scalar_frames = lockstep->backoff;
+      lockstep->backoff = lockstep->backoff < MAX_BACKOFF ? 2 * lockstep->backoff : MAX_BACKOFF;
+    }
+
+    for (int b = 0; b < lockstep->block_count; b++) {
+      Block* block = &lockstep->blocks[b];
+      block->DT -= (Bytes)(block->DT != 0) & 1;
+      block->ST -= (Bytes)(block->ST != 0) & 1;
+    }
+  }
+}
+
+void chip8_lockstep_stats(const Chip8Lockstep* lockstep, long* vector, long* scalar) {
+  assert(lockstep);
+  if (vector) {
+    *vector = lockstep->vector_steps;
+  }
+  if (scalar) {
+    *scalar = lockstep->scalar_steps;
+  }
+}
+
+
+// ----
+// Static functions
+
+static int run_lockstep(Chip8Lockstep* lockstep, long ipf) {
+  // Runs a frame in chunks the 16-bit budgets hold, returns 0 when the lanes
+  // diverged and the frame was finished scalar
+  for (long left = ipf; left > 0;) {
+    uint16_t chunk = left < CHUNK_SIZE ? left : CHUNK_SIZE;
+    left -= chunk;
+    for (int b = 0; b < lockstep->block_count; b++) {
+      Block* block = &lockstep->blocks[b];
+      block->remaining = block->used & chunk;
+    }
+    if (!run_rounds(lockstep, DIVERGED_ROUNDS * (long)chunk)) {
+      run_scalar(lockstep, left);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+LOCKSTEP_TARGETS
+static int run_rounds(Chip8Lockstep* lockstep, long limit) {
+  // Every round runs the lanes at the lowest PC with instructions left, so
+  // lanes behind on a path the others took can catch up to them. Returns 0
+  // when limit rounds were not enough to use up the budgets, or the lanes
+  // ran scalar so often the scalar path would have been faster.
+  Words lowest = ~(Words){0};
+  Words pending = {0};
+  for (int b = 0; b < lockstep->block_count; b++) {
+    Block* block = &lockstep->blocks[b];
+    Words waiting = (Words)(block->remaining != 0);
+    Words pc = block->PC | ~waiting;
+    lowest = SELECT((Words)(pc < lowest), pc, lowest);
+    pending |= waiting;
+  }
+
+  uint16_t target;
+  long vector_lanes = 0;
+  long visits = 0;
+  for (long round = 0; round < limit; round++) {
+    if (!lowest_pc(&lowest, &pending, &target)) {
+      return 1;
+    }
+    VectorOp op;
+    int vector = vector_op(lockstep, target, &op);
+    long lanes = 0;
+    lowest = ~(Words){0};
+    pending = (Words){0};
+    for (int b = 0; b < lockstep->block_count; b++) {
+      Block* block = &lockstep->blocks[b];
+      Words mask = (Words)(block->PC == target) & (Words)(block->remaining != 0);
+      if (lane_count(&mask)) {
+        if (vector) {
+          execute(block, &op, lockstep->quirks, target, &mask);
+          block->remaining -= mask & 1;
+          lanes += lane_count(&mask);
+        } else {
+          for (int i = 0; i < LANES; i++) {
+            if (mask[i]) {
+              run_lane(lockstep, b * LANES + i);
+              visits++;
+            }
+          }
+        }
+      }
+      // The next round is found while the block is still in cache
+      Words waiting = (Words)(block->remaining != 0);
+      Words pc = block->PC | ~waiting;
+      lowest = SELECT((Words)(pc < lowest), pc, lowest);
+      pending |= waiting;
+    }
+    lockstep->vector_steps += lanes;
+    vector_lanes += lanes;
+    // Every lane gets a few visits for free, frames start anywhere
+    if (visits * VISIT_COST > vector_lanes + (long)lockstep->count * VISIT_COST) {
+      return 0;
+    }
+  }
+  return !lowest_pc(&lowest, &pending, &target);
+}
+
+static void run_scalar(Chip8Lockstep* lockstep, long extra) {
+  // Each lane runs the rest of its budget plus extra instructions alone
+  for (int lane = 0; lane < lockstep->count; lane++) {
+    Block* block = &lockstep->blocks[lane / LANES];
+    long count = block->remaining[lane % LANES] + extra;
+    block->remaining[lane % LANES] = 0;
+    lane_to_chip(lockstep, lane);
+    Chip8* chip = &lockstep->chips[lane];
+    for (long i = 0; i < count; i++) {
+      mark_stores(lockstep, chip);
+      chip8_step(chip);
+    }
+    lockstep->scalar_steps += count;
+    chip_to_lane(lockstep, lane);
+  }
+}
+
+ROUND_HELPER int vector_op(const Chip8Lockstep* lockstep, uint16_t pc, VectorOp* op) {
+  // Returns 1 when every lane fetches the same instruction at pc and it has
+  // a vector form
+  uint16_t opcode = (uint16_t)(lockstep->image[pc] << 8 | lockstep->image[(uint16_t)(pc + 1)]);
+  op->opcode = opcode;
+  op->skip = 2;
+  if (was_written(lockstep, pc, 2)) {
+    return 0;
+  }
+  uint16_t next = pc + 2;
+  switch (opcode & 0xF000) {
+    case 0x1000: // JP addr
+    case 0x6000: // LD Vx, byte
+    case 0x7000: // ADD Vx, byte
+    case 0xA000: // LD I, addr
+    case 0xB000: // JP V0, addr
+      return 1;
+    case 0x5000:
+      if ((opcode & 0xF) == 0x2 || (opcode & 0xF) == 0x3) {
+        return 0;
+      }
+      // fall through
+    case 0x3000:
+    case 0x4000:
+    case 0x9000:
+      // Skips over F000 nnnn take four bytes, the next instruction decides
+      if (was_written(lockstep, next, 2)) {
+        return 0;
+      }
+      if (lockstep->image[next] == 0xF0 && lockstep->image[(uint16_t)(next + 1)] == 0x00) {
+        op->skip = 4;
+      }
+      return 1;
+    case 0x8000:
+      return (opcode & 0xF) <= 0x7 || (opcode & 0xF) == 0xE;
+    case 0xF000:
+      switch (opcode & 0xFF) {
+        case 0x07:
+        case 0x15:
+        case 0x18:
+        case 0x1E:
+        case 0x29:
+          return 1;
+      }
+      return 0;
+  }
+  return 0;
+}
+
+ROUND_HELPER void execute(Block* block, const VectorOp* op, uint8_t quirks, uint16_t pc, const Words* mask) {
+  // Same results as the interpreter handlers, on the mask lanes only
+  uint8_t x = (op->opcode >> 8) & 0xF;
+  uint8_t y = (op->opcode >> 4) & 0xF;
+  uint8_t kk = op->opcode & 0xFF;
+  uint16_t nnn = op->opcode & 0xFFF;
+  Bytes lanes = __builtin_convertvector(*mask, Bytes);
+  Bytes* V = block->V;
+  Words next = (Words){0} + (uint16_t)(pc + 2);
+  Words taken = {0}; // skip lanes
+
+  switch (op->opcode & 0xF000) {
+    case 0x1000: // 1nnn - JP addr
+      next = (Words){0} + nnn;
+      break;
+    case 0x3000: // 3xkk - SE Vx, byte
+      taken = (Words)__builtin_convertvector(V[x] == kk, SignedWords);
+      break;
+    case 0x4000: // 4xkk - SNE Vx, byte
+      taken = (Words)__builtin_convertvector(V[x] != kk, SignedWords);
+      break;
+    case 0x5000: // 5xy0 - SE Vx, Vy
+      taken = (Words)__builtin_convertvector(V[x] == V[y], SignedWords);
+      break;
+    case 0x6000: // 6xkk - LD Vx, byte
+      V[x] = SELECT(lanes, (Bytes){0} + kk, V[x]);
+      break;
+    case 0x7000: // 7xkk - ADD Vx, byte
+      V[x] = SELECT(lanes, V[x] + kk, V[x]);
+      break;
+    case 0x8000: {
+      Bytes vx = V[x];
+      Bytes vy = V[y];
+      Bytes result;
+      Bytes flag = {0};
+      int keep_flag = 0; // VF untouched, so a result written to VF stays
+      switch (op->opcode & 0xF) {
+        case 0x0: // 8xy0 - LD Vx, Vy
+          result = vy;
+          keep_flag = 1;
+          break;
+        case 0x1: // 8xy1 - OR Vx, Vy
+          result = vx | vy;
+          keep_flag = quirks & CHIP8_QUIRK_KEEP_VF;
+          break;
+        case 0x2: // 8xy2 - AND Vx, Vy
+          result = vx & vy;
+          keep_flag = quirks & CHIP8_QUIRK_KEEP_VF;
+          break;
+        case 0x3: // 8xy3 - XOR Vx, Vy
+          result = vx ^ vy;
+          keep_flag = quirks & CHIP8_QUIRK_KEEP_VF;
+          break;
+        case 0x4: // 8xy4 - ADD Vx, Vy
+          result = vx + vy;
+          flag = (Bytes)(result < vx) & 1;
+          break;
+        case 0x5: // 8xy5 - SUB Vx, Vy
+          result = vx - vy;
+          flag = (Bytes)(vx >= vy) & 1;
+          break;
+        case 0x6: // 8xy6 - SHR Vx {, Vy}
+          vy = (quirks & CHIP8_QUIRK_SHIFT) ? vx : vy;
+          result = vy >> 1;
+          flag = vy & 1;
+          break;
+        case 0x7: // 8xy7 - SUBN Vx, Vy
+          result = vy - vx;
+          flag = (Bytes)(vy >= vx) & 1;
+          break;
+        default: // 8xyE - SHL Vx {, Vy}
+          vy = (quirks & CHIP8_QUIRK_SHIFT) ? vx : vy;
+          result = vy << 1;
+          flag = vy >> 7;
+          break;
+      }
+      // VF is written last, it wins when x is F
+      V[x] = SELECT(lanes, result, V[x]);
+      if (!keep_flag) {
+        V[0xF] = SELECT(lanes, flag, V[0xF]);
+      }
+      break;
+    }
+    case 0x9000: // 9xy0 - SNE Vx, Vy
+      taken = (Words)__builtin_convertvector(V[x] != V[y], SignedWords);
+      break;
+    case 0xA000: // Annn - LD I, addr
+      block->I = SELECT(*mask, (Words){0} + nnn, block->I);
+      break;
+    case 0xB000: // Bnnn - JP V0, addr, Bxnn - JP Vx, addr with the jump quirk
+      next = __builtin_convertvector(V[(quirks & CHIP8_QUIRK_JUMP) ? x : 0], Words) + nnn;
+      break;
+    default:
+      switch (kk) {
+        case 0x07: // Fx07 - LD Vx, DT
+          V[x] = SELECT(lanes, block->DT, V[x]);
+          break;
+        case 0x15: // Fx15 - LD DT, Vx
+          block->DT = SELECT(lanes, V[x], block->DT);
+          break;
+        case 0x18: // Fx18 - LD ST, Vx
+          block->ST = SELECT(lanes, V[x], block->ST);
+          break;
+        case 0x1E: // Fx1E - ADD I, Vx
+          block->I = SELECT(*mask, block->I + __builtin_convertvector(V[x], Words), block->I);
+          break;
+        default: // Fx29 - LD F, Vx
+          block->I = SELECT(*mask, __builtin_convertvector(V[x], Words) * 5, block->I);
+          break;
+      }
+      break;
+  }
+  next += taken & op->skip;
+  block->PC = SELECT(*mask, next, block->PC);
+}
+
+static void run_lane(Chip8Lockstep* lockstep, int lane) {
+  // Steps the lane until an instruction with a vector form comes up, each
+  // trip to its Chip8 costs cache misses worth several instructions
+  Block* block = &lockstep->blocks[lane / LANES];
+  int i = lane % LANES;
+  lane_to_chip(lockstep, lane);
+  Chip8* chip = &lockstep->chips[lane];
+  VectorOp op;
+  long count = 0;
+  do {
+    mark_stores(lockstep, chip);
+    chip8_step(chip);
+    count++;
+  } while (count < block->remaining[i] && !vector_op(lockstep, chip->PC, &op));
+  block->remaining[i] -= count;
+  lockstep->scalar_steps += count;
+  chip_to_lane(lockstep, lane);
+}
+
+static void mark_stores(Chip8Lockstep* lockstep, const Chip8* chip) {
+  // No lane fetches the bytes the next instruction of chip stores from the
+  // prototype any more
+  uint16_t pc = chip->PC;
+  uint16_t opcode = (uint16_t)(chip->memory[pc] << 8 | chip->memory[(uint16_t)(pc + 1)]);
+  uint8_t x = (opcode >> 8) & 0xF;
+  uint8_t y = (opcode >> 4) & 0xF;
+  if ((opcode & 0xF00F) == 0x5002) { // 5xy2 - LD [I], Vx - Vy
+    mark_written(lockstep, chip->I, (x <= y ? y - x : x - y) + 1);
+  } else if ((opcode & 0xF0FF) == 0xF033) { // Fx33 - LD B, Vx
+    mark_written(lockstep, chip->I, 3);
+  } else if ((opcode & 0xF0FF) == 0xF055) { // Fx55 - LD [I], Vx
+    mark_written(lockstep, chip->I, x + 1);
+  }
+}
+
+static void lane_to_chip(Chip8Lockstep* lockstep, int lane) {
+  const Block* block = &lockstep->blocks[lane / LANES];
+  Chip8* chip = &lockstep->chips[lane];
+  int i = lane % LANES;
+  for (int r = 0; r < REGISTERS_SIZE; r++) {
+    chip->registers[r] = block->V[r][i];
+  }
+  chip->DT = block->DT[i];
+  chip->ST = block->ST[i];
+  chip->I = block->I[i];
+  chip->PC = block->PC[i];
+}
+
+static void chip_to_lane(Chip8Lockstep* lockstep, int lane) {
+  Block* block = &lockstep->blocks[lane / LANES];
+  const Chip8* chip = &lockstep->chips[lane];
+  int i = lane % LANES;
+  for (int r = 0; r < REGISTERS_SIZE; r++) {
+    block->V[r][i] = chip->registers[r];
+  }
+  block->DT[i] = chip->DT;
+  block->ST[i] = chip->ST;
+  block->I[i] = chip->I;
+  block->PC[i] = chip->PC;
+}
+
+static void mark_written(Chip8Lockstep* lockstep, uint16_t address, int length) {
+  for (int i = 0; i < length; i++) {
+    uint16_t a = address + i;
+    lockstep->written[a / 8] |= 1 << (a % 8);
+  }
+}
+
+ROUND_HELPER int was_written(const Chip8Lockstep* lockstep, uint16_t address, int length) {
+  for (int i = 0; i < length; i++) {
+    uint16_t a = address + i;
+    if ((lockstep->written[a / 8] >> (a % 8)) & 1) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+ROUND_HELPER int lowest_pc(const Words* lowest, const Words* pending, uint16_t* pc) {
+  // Returns 0 when no lane has instructions left
+  if (!lane_count(pending)) {
+    return 0;
+  }
+  uint16_t best = 0xFFFF;
+  for (int i = 0; i < LANES; i++) {
+    best = (*lowest)[i] < best ? (*lowest)[i] : best;
+  }
+  *pc = best;
+  return 1;
+}
+
+ROUND_HELPER int lane_count(const Words* mask) {
+  uint64_t words[sizeof(Words) / 8];
+  memcpy(words, mask, sizeof(words));
+  int bits = 0;
+  for (size_t i = 0; i < sizeof(Words) / 8; i++) {
+    bits += __builtin_popcountll(words[i]);
+  }
+  return bits / 16;
+}
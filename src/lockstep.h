@@ -0,0 +1,37 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "chip8.h"
+
+#include <stdint.h>
+
+// Many instances of the same machine executed together on one core. The
+// registers, I, PC and timers of every lane are kept as struct of arrays,
+// each round the lanes sharing the lowest PC run that instruction at once
+// with vector operations while the others wait. Lanes that take another
+// path catch up in later rounds.
+//
+// Only register, I, timer, skip and jump instructions are vectorized.
+// Instructions touching memory, the display, the stack, keys or random
+// numbers run through chip8_step on the lane's own Chip8, so do lanes at
+// code some lane has written. When lanes stop meeting or mostly run scalar,
+// the rest of the frame and a few frames after it run one lane at a time
+// before lockstep is tried again.
+typedef struct Chip8Lockstep Chip8Lockstep;
+
+// Every lane starts as a copy of prototype, lane i seeded with seed + i.
+// Returns NULL when out of memory.
+Chip8Lockstep* chip8_lockstep_create(int count, const Chip8* prototype, uint64_t seed);
+void chip8_lockstep_destroy(Chip8Lockstep* lockstep);
+
+int chip8_lockstep_count(const Chip8Lockstep* lockstep);
+// Complete state of a lane, valid until the next run which also drops
+// changes made to it
+Chip8* chip8_lockstep_instance(Chip8Lockstep* lockstep, int index);
+void chip8_lockstep_set_keys(Chip8Lockstep* lockstep, int index, uint16_t keys);
+// Runs frames frames, each ipf instructions per lane then a timer tick
+void chip8_lockstep_run(Chip8Lockstep* lockstep, long ipf, long frames);
+// Lane instructions executed by vector operations and by chip8_step so far
+void chip8_lockstep_stats(const Chip8Lockstep* lockstep, long* vector, long* scalar);
+
+#endif
@@ -1,22 +1,39 @@
-#define _POSIX_C_SOURCE 199309L // Needed to include nanosleep
+#define _POSIX_C_SOURCE 200809L // Needed for getopt and pthreads
 
 #include "graphics.h"
 #include "chip8.h"
+#include "rewind.h"
+#include "triple_buffer.h"
+#include "scheduler.h"
+#include "profile.h"
+#include "trace.h"
+#include "movie.h"
+#include "audio.h"
 
 #include <GL/gl.h>
-#include <bits/time.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <assert.h>
 #include <GLFW/glfw3.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
-#include <sys/time.h>
+#include <unistd.h>
 
 
 #define KEY_DEBUG 0x42 // B
 #define KEY_STEP 0x4E  // N
 #define KEY_FULLSCREEN 0x12C // F11
 #define KEY_EXIT 0x100 // Esc
+#define KEY_REWIND 0x103 // Backspace
+#define KEY_PROFILE 0x50 // P
+
+#define REWIND_BUFFER_SIZE (8 * 1024 * 1024)
+#define REWIND_MAX_FRAMES (60 * 60 * 5) // 5 minutes at 60Hz
+#define REWIND_KEYFRAME_INTERVAL 300
+
+#define UNLIMITED_BATCH 1000 // instructions between clock checks without an IPF limit
 
 #define KEY_0 0x58 // X
 #define KEY_1 0x31 // 1
@@ -35,32 +52,71 @@
 #define KEY_E 0x46 // F
 #define KEY_F 0x56 // V
 
+// Shared by the window thread and the emulation thread. Everything except
+// chip and history is only accessed atomically.
 typedef struct {
-  int fullscreen_lock; // prevent rapid change of full screen
-  int debug_lock;
-  int step_lock;
+  Chip8 chip; // owned by the emulation thread
+  RewindBuffer* history; // owned by the emulation thread
+  TraceWriter* trace; // owned by the emulation thread, NULL when not tracing
+  Movie* movie; // owned by the emulation thread, NULL when not recording
+  AudioEngine* audio; // fed by the emulation thread
+  int recording; // 1 while frames are added to the movie
+  long ipf; // instructions per frame, 0 for unlimited
+  TripleBuffer frames; // completed frames for the window thread
+  uint16_t keys; // bit i set while CHIP-8 key i is held
   int step; // when 1 should run a step, in debug mode
   int mode; // 1 debug, 0 normal
+  int rewind; // 1 while the rewind key is held
+  int report; // when 1 should write the profile report
+  int quit;
+  // Input events wake the emulation thread up before its next frame
+  pthread_mutex_t wake_lock;
+  pthread_cond_t wake; // uses the monotonic clock
+  unsigned int events; // incremented under wake_lock for every event
+} Emulator;
+
+// Window thread state, reached from the GLFW callbacks
+typedef struct {
+  Emulator* emulator;
   int refresh_window; // Flag to refresh window
 } State;
 
+static void* emulation_thread(void* arg);
+static void run_frame(Emulator* emulator, long instructions, int rewind);
+static void step(Emulator* emulator);
+static int run_instructions(Emulator* emulator, long count);
+static void notify(Emulator* emulator);
+static void wait_for_event(Emulator* emulator, unsigned int seen, uint64_t deadline);
 static void print_debug(Chip8* chip);
-static void update_keyboard_input(GLFWwindow* window, Chip8* chip8, State* state);
+static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
+static int keypad_index(int key);
 static void update_window_viewport(GLFWwindow* window, int* width, int* height, State* state);
-static void update_color_buffer(Chip8* chip, unsigned int vbo_color, unsigned short* color_buffer, int count);
-
-long current_time_millis() {
-  struct timeval tp;
-  gettimeofday(&tp, NULL);
-  return tp.tv_sec * 1000 + tp.tv_usec / 1000;
-}
 
 
 int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    printf("Usage: %s <filename>\n", argv[0]);
+  long ipf = CHIP8_DEFAULT_IPF;
+  const char* trace_file = NULL;
+  const char* movie_file = NULL;
+  const char* audio_file = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:T:r:a:")) != -1) {
+    if (opt == 'T') {
+      trace_file = optarg;
+    } else if (opt == 'a') {
+      audio_file = optarg;
+    } else if (opt == 'r') {
+      movie_file = optarg;
+    } else if (opt != 'i' || (ipf = atol(optarg)) < 0) {
+      optind = argc;
+      break;
+    }
+  }
+  // Unlimited runs depend on the host speed, they can not be replayed
+  if (optind != argc - 1 || (movie_file && !ipf)) {
+    printf("Usage: %s [-i instructions per frame, 0 for unlimited] [-T trace file] [-r movie file] [-a wav file] <filename>\n", argv[0]);
     return 0;
   }
+  const char* filename = argv[optind];
 
   int width = WINDOW_WIDTH;
   int height = WINDOW_HEIGHT;
@@ -73,144 +129,338 @@ int main(int argc, char* argv[]) {
     return -1;
   }
 
-  unsigned int vbo_pos, vbo_color, ibo;
-  int draw_count = 0;
-  draw_count = setup_buffers(&vbo_pos, &vbo_color, &ibo);
-  int cb_count = DISPLAY_WIDTH * DISPLAY_HEGIHT * 4;
-  unsigned short color_buffer[cb_count];
-  for (int i = 0; i < cb_count; i++) {
-    color_buffer[i] = 0;
-  }
+  unsigned int texture;
+  setup_display(&texture);
 
   // Setup CHIP-8
-  Chip8 chip;
-  chip8_init(&chip);
-  if (chip8_load_file(&chip, argv[1])) {
-    printf("Failed to load file: %s\n", argv[1]);
+  static Emulator emulator;
+  Chip8* chip = &emulator.chip;
+  uint64_t seed = time(NULL);
+  chip8_init(chip);
+  chip8_seed(chip, seed);
+  if (chip8_load_file(chip, filename)) {
+    printf("Failed to load file: %s\n", filename);
     glfwDestroyWindow(window);
     glfwTerminate();
     return -1;
   }
 
   State state = {
-    .fullscreen_lock = 0,
-    .debug_lock = 0,
-    .step_lock = 0,
-    .mode = 0,
+    .emulator = &emulator,
     .refresh_window = 1
   };
+  glfwSetWindowUserPointer(window, &state);
+  glfwSetKeyCallback(window, key_callback);
+
+  emulator.history = rewind_buffer_create(REWIND_BUFFER_SIZE, REWIND_MAX_FRAMES, REWIND_KEYFRAME_INTERVAL);
+  if (!emulator.history) {
+    printf("Failed to allocate rewind buffer\n");
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return -1;
+  }
+  triple_buffer_init(&emulator.frames);
+  emulator.ipf = ipf;
+  pthread_condattr_t wake_attr;
+  pthread_condattr_init(&wake_attr);
+  pthread_condattr_setclock(&wake_attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&emulator.wake_lock, NULL);
+  pthread_cond_init(&emulator.wake, &wake_attr);
+  pthread_condattr_destroy(&wake_attr);
+  if (trace_file) {
+    emulator.trace = trace_writer_open(trace_file, chip);
+    if (!emulator.trace) {
+      printf("Failed to create trace: %s\n", trace_file);
+      rewind_buffer_destroy(emulator.history);
+      glfwDestroyWindow(window);
+      glfwTerminate();
+      return -1;
+    }
+  }
+  if (movie_file) {
+    emulator.movie = movie_create(seed, ipf, chip->quirks);
+    emulator.recording = 1;
+    if (!emulator.movie) {
+      printf("Failed to allocate movie\n");
+      trace_writer_close(emulator.trace);
+      rewind_buffer_destroy(emulator.history);
+      glfwDestroyWindow(window);
+      glfwTerminate();
+      return -1;
+    }
+  }
+
+  // Without a file the buzzer rings the terminal bell
+  emulator.audio = audio_create(audio_file ? audio_wav_sink(audio_file) : audio_bell_sink());
+  if (!emulator.audio) {
+    printf("Failed to create audio output: %s\n", audio_file ? audio_file : "bell");
+    movie_destroy(emulator.movie);
+    trace_writer_close(emulator.trace);
+    rewind_buffer_destroy(emulator.history);
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return -1;
+  }
+
+  // The CHIP-8 runs on its own thread, a blocking buffer swap or window
+  // event handling here never stalls it
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, emulation_thread, &emulator)) {
+    printf("Failed to start emulation thread\n");
+    audio_destroy(emulator.audio);
+    movie_destroy(emulator.movie);
+    trace_writer_close(emulator.trace);
+    rewind_buffer_destroy(emulator.history);
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return -1;
+  }
 
-  long time_per_frame = 1000 / 60; // 60Hz
-  long accumulated_time = 0;
-  long previous_time = current_time_millis();
   while(!glfwWindowShouldClose(window)) {
-    long now = current_time_millis();
-    long deltatime = now - previous_time; // in milliseconds
-    previous_time = now;
-    accumulated_time += deltatime;
+    // Woken up by window events and by the emulation thread publishing frames
+    glfwWaitEvents();
 
-    update_keyboard_input(window, &chip, &state);
     update_window_viewport(window, &width, &height, &state);
 
-    // idk if this is better
-    // it seems that the display of test 5 can be fixed by moving the step out
-    // side the time check
-    if (state.mode == 0) {
-      if (accumulated_time >= time_per_frame) {
-        chip8_timer_tick(&chip);
-        accumulated_time -= time_per_frame;
-      }
-      chip8_step(&chip);
-    } else if (state.step) {
-      print_debug(&chip);
-      chip8_timer_tick(&chip);
-      chip8_step(&chip);
-      state.step = 0;
-      accumulated_time = 0;
-    }
-
-    if (chip.draw_flag) {
-      update_color_buffer(&chip, vbo_color, color_buffer, cb_count);
-      chip.draw_flag = 0;
+    Frame* frame = triple_buffer_take(&emulator.frames);
+    if (frame) {
+      upload_display(texture, &frame->pixels[0][0][0], frame->hires, frame->dirty_rows);
       state.refresh_window = 1;
     }
     if (state.refresh_window) {
       glClear(GL_COLOR_BUFFER_BIT);
-      glDrawElements(GL_TRIANGLES, draw_count, GL_UNSIGNED_SHORT, NULL);
+      draw_display();
       glfwSwapBuffers(window);
       state.refresh_window = 0;
     }
+  }
 
-    glfwPollEvents();
-
-    // Sleep to prevent CPU hog
-    struct timespec req = {
-      .tv_sec = 0,
-      .tv_nsec = 1000000L
-    };
-    nanosleep(&req, NULL);
+  __atomic_store_n(&emulator.quit, 1, __ATOMIC_RELEASE);
+  notify(&emulator);
+  pthread_join(thread, NULL);
+  pthread_cond_destroy(&emulator.wake);
+  pthread_mutex_destroy(&emulator.wake_lock);
+  if (audio_destroy(emulator.audio) && audio_file) {
+    printf("Failed to write audio: %s\n", audio_file);
+  }
+#ifdef CHIP8_PROFILE
+  if (profile_report(stdout, PROFILE_JSON_FILE)) {
+    printf("Failed to write profile: %s\n", PROFILE_JSON_FILE);
+  }
+#endif
+  if (trace_writer_close(emulator.trace)) {
+    printf("Failed to write trace: %s\n", trace_file);
   }
+  if (emulator.movie && movie_save(emulator.movie, movie_file)) {
+    printf("Failed to write movie: %s\n", movie_file);
+  }
+  movie_destroy(emulator.movie);
 
+  rewind_buffer_destroy(emulator.history);
   glfwDestroyWindow(window);
   glfwTerminate();
   return 0;
 }
 
 
+static void* emulation_thread(void* arg) {
+  Emulator* emulator = arg;
+  Chip8* chip = &emulator->chip;
+
+  Scheduler scheduler;
+  scheduler_init(&scheduler, emulator->ipf);
+  while (!__atomic_load_n(&emulator->quit, __ATOMIC_ACQUIRE)) {
+    // Events after this point wake the waits below up
+    unsigned int seen = __atomic_load_n(&emulator->events, __ATOMIC_ACQUIRE);
+    chip->keys = __atomic_load_n(&emulator->keys, __ATOMIC_RELAXED);
+    int rewind = __atomic_load_n(&emulator->rewind, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&emulator->mode, __ATOMIC_RELAXED) == 0) {
+      if (!scheduler.ipf) {
+        // No limit, keep running until the frame is over. A machine waiting
+        // for a key or the timer sleeps until one of them can change.
+        while (!rewind && time_now_ns() < scheduler.next_frame) {
+          if (run_instructions(emulator, UNLIMITED_BATCH)) {
+            wait_for_event(emulator, seen, scheduler.next_frame);
+          }
+          seen = __atomic_load_n(&emulator->events, __ATOMIC_ACQUIRE);
+          chip->keys = __atomic_load_n(&emulator->keys, __ATOMIC_RELAXED);
+        }
+      }
+      // Frames missed while the thread was stalled run back to back
+      int due = scheduler_frames_due(&scheduler, time_now_ns());
+      for (int i = 0; i < due; i++) {
+        run_frame(emulator, scheduler.ipf, rewind);
+      }
+    } else {
+      if (__atomic_load_n(&emulator->step, __ATOMIC_ACQUIRE)) {
+        print_debug(chip);
+        audio_push(emulator->audio, chip);
+        chip8_timer_tick(chip);
+        step(emulator);
+        __atomic_store_n(&emulator->step, 0, __ATOMIC_RELEASE);
+      }
+      // Resume at the normal pace once debug mode ends
+      scheduler_reset(&scheduler, time_now_ns());
+    }
 
+    if (chip->dirty_rows) {
+      Frame* frame = triple_buffer_back(&emulator->frames);
+      memcpy(frame->pixels, chip->pixels, sizeof(frame->pixels));
+      frame->hires = chip->hires;
+      frame->dirty_rows = chip->dirty_rows;
+      triple_buffer_publish(&emulator->frames);
+      chip->dirty_rows = 0;
+      glfwPostEmptyEvent();
+    }
 
-static void update_keyboard_input(GLFWwindow* window, Chip8* chip, State* state) {
-  assert(window);
-  assert(chip);
-  assert(state);
-
-  int key_state = 0;
+#ifdef CHIP8_PROFILE
+    // Counters are only touched by this thread, the report is written here
+    if (__atomic_exchange_n(&emulator->report, 0, __ATOMIC_RELAXED)) {
+      if (profile_report(stdout, PROFILE_JSON_FILE)) {
+        printf("Failed to write profile: %s\n", PROFILE_JSON_FILE);
+      }
+    }
+#endif
 
-  // Check for escape key press
-  key_state = glfwGetKey(window, KEY_EXIT);
-  if (key_state == GLFW_PRESS) {
-    glfwSetWindowShouldClose(window, GLFW_TRUE);
+    wait_for_event(emulator, seen, scheduler.next_frame);
   }
+  return NULL;
+}
 
-  // Check for full screen toggle
-  key_state = glfwGetKey(window, KEY_FULLSCREEN);
-  if (key_state == GLFW_PRESS) {
-    if (!state->fullscreen_lock) {
-      toggleFullScreen(window);
-      state->refresh_window = 1;
-      state->fullscreen_lock = 1;
+static void run_frame(Emulator* emulator, long instructions, int rewind) {
+  Chip8* chip = &emulator->chip;
+
+  // One frame back per tick while rewinding, otherwise record the frame.
+  // The movie drops rewound frames, replaying it takes the path kept.
+  if (rewind) {
+    if (!rewind_buffer_step_back(emulator->history, chip) && emulator->recording) {
+      movie_truncate(emulator->movie, emulator->movie->frames - 1);
     }
+    return;
+  }
+  if (emulator->recording) {
+    if (movie_append(emulator->movie, chip->keys)) {
+      // The frames so far still replay, they are saved at exit
+      printf("Out of memory for the movie, recording stopped\n");
+      emulator->recording = 0;
+    }
+  }
+  run_instructions(emulator, instructions);
+  audio_push(emulator->audio, chip);
+  chip8_timer_tick(chip);
+  rewind_buffer_push(emulator->history, chip);
+}
+
+static void step(Emulator* emulator) {
+  // Rewound frames are not recorded, the trace jumps to the restored PC
+  if (emulator->trace) {
+    trace_writer_step(emulator->trace, &emulator->chip);
   } else {
-    state->fullscreen_lock = 0;
+    chip8_step(&emulator->chip);
   }
+}
 
-  // Check for debug toggle
-  key_state = glfwGetKey(window, KEY_DEBUG);
-  if (key_state == GLFW_PRESS) {
-    if (!state->debug_lock) {
-      state->mode = (state->mode) ? 0 : 1;
-      state->debug_lock = 1;
+static int run_instructions(Emulator* emulator, long count) {
+  // Returns 1 when the machine ended waiting for a key or the timer, only
+  // detected without a trace since the trace records every instruction
+  if (emulator->trace) {
+    for (long i = 0; i < count; i++) {
+      step(emulator);
     }
-  } else {
-    state->debug_lock = 0;
+    return 0;
   }
+  return chip8_run(&emulator->chip, count);
+}
 
-  // Check for step
-  key_state = glfwGetKey(window, KEY_STEP);
-  if (key_state == GLFW_PRESS) {
-    if (!state->step_lock) {
-      state->step = 1;
-      state->step_lock = 1;
+static void notify(Emulator* emulator) {
+  pthread_mutex_lock(&emulator->wake_lock);
+  __atomic_add_fetch(&emulator->events, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&emulator->wake);
+  pthread_mutex_unlock(&emulator->wake_lock);
+}
+
+static void wait_for_event(Emulator* emulator, unsigned int seen, uint64_t deadline) {
+  // Sleeps until the deadline or an event after seen, whichever is first
+  struct timespec ts = {
+    .tv_sec = deadline / 1000000000ULL,
+    .tv_nsec = deadline % 1000000000ULL
+  };
+  pthread_mutex_lock(&emulator->wake_lock);
+  while (__atomic_load_n(&emulator->events, __ATOMIC_RELAXED) == seen) {
+    if (pthread_cond_timedwait(&emulator->wake, &emulator->wake_lock, &ts)) {
+      break; // timed out
     }
-  } else {
-    state->step_lock = 0;
   }
+  pthread_mutex_unlock(&emulator->wake_lock);
+}
+
+static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+  (void)scancode;
+  (void)mods;
+  State* state = glfwGetWindowUserPointer(window);
+  assert(state);
+  Emulator* emulator = state->emulator;
+
+  // Held keys only change on press and release, repeats are ignored
+  if (action == GLFW_REPEAT) {
+    return;
+  }
+  int pressed = action == GLFW_PRESS;
+
+  int index = keypad_index(key);
+  if (index >= 0) {
+    if (pressed) {
+      __atomic_or_fetch(&emulator->keys, 1 << index, __ATOMIC_RELAXED);
+    } else {
+      __atomic_and_fetch(&emulator->keys, ~(1 << index), __ATOMIC_RELAXED);
+    }
+    notify(emulator);
+    return;
+  }
+
+  if (key == KEY_REWIND) {
+    __atomic_store_n(&emulator->rewind, pressed, __ATOMIC_RELAXED);
+    notify(emulator);
+    return;
+  }
+  if (!pressed) {
+    return;
+  }
+  switch (key) {
+    case KEY_EXIT:
+      glfwSetWindowShouldClose(window, GLFW_TRUE);
+      break;
+    case KEY_FULLSCREEN:
+      toggleFullScreen(window);
+      state->refresh_window = 1;
+      break;
+    case KEY_DEBUG:
+      // Single steps can not be replayed, no debug mode while recording
+      if (!emulator->movie) {
+        __atomic_xor_fetch(&emulator->mode, 1, __ATOMIC_RELAXED);
+      }
+      break;
+    case KEY_STEP:
+      __atomic_store_n(&emulator->step, 1, __ATOMIC_RELEASE);
+      break;
+    case KEY_PROFILE:
+      __atomic_store_n(&emulator->report, 1, __ATOMIC_RELAXED);
+      break;
+  }
+  notify(emulator);
+}
 
-  // Update keys
-  int keys[] = {KEY_0, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F};
-  for (uint8_t i = 0; i < KEYS_SIZE; i++) {
-    chip->keys[i] = glfwGetKey(window, keys[i]);
+static int keypad_index(int key) {
+  // CHIP-8 key for a keyboard key, -1 when it is not on the keypad
+  static const int keys[KEYS_SIZE] = {KEY_0, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7,
+                                      KEY_8, KEY_9, KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F};
+  for (int i = 0; i < KEYS_SIZE; i++) {
+    if (keys[i] == key) {
+      return i;
+    }
   }
+  return -1;
 }
 
 
@@ -227,39 +477,6 @@ static void update_window_viewport(GLFWwindow* window, int* width, int* height,
   }
 }
 
-static void update_color_buffer(Chip8* chip, unsigned int vbo_color, unsigned short* color_buffer, int count) {
-  assert(chip);
-  assert(color_buffer);
-
-  unsigned short* buf_ptr = color_buffer;
-  uint64_t mask = 0;
-
-  for (int y = 0; y < DISPLAY_HEGIHT; y++) {
-    for (int x = DISPLAY_WIDTH - 1; x >= 0; x--) {
-      mask = (uint64_t)0x1;
-      mask = mask << x;
-      if (chip->pixels[y] & mask) {
-        buf_ptr[0] = 1;
-        buf_ptr[1] = 1;
-        buf_ptr[2] = 1;
-        buf_ptr[3] = 1;
-      } else {
-        buf_ptr[0] = 0;
-        buf_ptr[1] = 0;
-        buf_ptr[2] = 0;
-        buf_ptr[3] = 0;
-      }
-
-      buf_ptr += 4;
-    }
-  }
-
-  glBindBuffer(GL_ARRAY_BUFFER, vbo_color);
-  glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(unsigned short), color_buffer);
-}
-
-
-
 static void print_debug(Chip8* chip) {
   assert(chip);
 
@@ -269,7 +486,7 @@ static void print_debug(Chip8* chip) {
   uint16_t opcode;
   opcode = chip->memory[chip->PC]; // Upper byte
   opcode = opcode << 8;
-  opcode = opcode | chip->memory[chip->PC + 1]; // Lower byte
+  opcode = opcode | chip->memory[(uint16_t)(chip->PC + 1)]; // Lower byte
 
   printf("PC: 0x%04X | SP: 0x%02X | I: 0x%04X | Opcode: 0x%04X\n", chip->PC, chip->SP, chip->I, opcode);
   printf("Registers: ");
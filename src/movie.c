@@ -0,0 +1,126 @@
+#include "movie.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY (60 * 60) // a minute at 60Hz
+
+
+Movie* movie_create(uint64_t seed, long ipf, uint8_t quirks) {
+  assert(ipf > 0);
+
+  Movie* movie = malloc(sizeof(Movie));
+  if (!movie) {
+    return NULL;
+  }
+  movie->keys = malloc(INITIAL_CAPACITY * sizeof(uint16_t));
+  if (!movie->keys) {
+    free(movie);
+    return NULL;
+  }
+  movie->seed = seed;
+  movie->ipf = ipf;
+  movie->quirks = quirks;
+  movie->frames = 0;
+  movie->capacity = INITIAL_CAPACITY;
+  return movie;
+}
+
+void movie_destroy(Movie* movie) {
+  if (!movie) {
+    return;
+  }
+  free(movie->keys);
+  free(movie);
+}
+
+int movie_append(Movie* movie, uint16_t keys) {
+  assert(movie);
+  if (movie->frames == movie->capacity) {
+    uint16_t* grown = realloc(movie->keys, 2 * movie->capacity * sizeof(uint16_t));
+    if (!grown) {
+      return 1;
+    }
+    movie->keys = grown;
+    movie->capacity = 2 * movie->capacity;
+  }
+  movie->keys[movie->frames++] = keys;
+  return 0;
+}
+
+void movie_truncate(Movie* movie, long frames) {
+  assert(movie);
+  assert(frames >= 0);
+  if (frames < movie->frames) {
+    movie->frames = frames;
+  }
+}
+
+int movie_save(const Movie* movie, const char* filename) {
+  assert(movie);
+  assert(filename);
+
+  uint8_t header[MOVIE_HEADER_SIZE] = {'C', '8', 'M', 'V', MOVIE_VERSION, movie->quirks, 0, 0};
+  for (int i = 0; i < 8; i++) {
+    header[8 + i] = (movie->seed >> (8 * i)) & 0xFF;
+  }
+  for (int i = 0; i < 4; i++) {
+    header[16 + i] = ((uint32_t)movie->ipf >> (8 * i)) & 0xFF;
+  }
+
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    return 1;
+  }
+  int failed = fwrite(header, 1, sizeof(header), fp) != sizeof(header);
+  for (long i = 0; i < movie->frames && !failed; i++) {
+    uint8_t frame[2] = {movie->keys[i] & 0xFF, movie->keys[i] >> 8};
+    failed = fwrite(frame, 1, sizeof(frame), fp) != sizeof(frame);
+  }
+  if (fclose(fp)) {
+    failed = 1;
+  }
+  return failed;
+}
+
+Movie* movie_load(const char* filename) {
+  assert(filename);
+
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    return NULL;
+  }
+  uint8_t header[MOVIE_HEADER_SIZE];
+  if (fread(header, 1, sizeof(header), fp) != sizeof(header)
+      || memcmp(header, "C8MV", 4) || header[4] != MOVIE_VERSION) {
+    fclose(fp);
+    return NULL;
+  }
+  uint64_t seed = 0;
+  for (int i = 0; i < 8; i++) {
+    seed |= (uint64_t)header[8 + i] << (8 * i);
+  }
+  uint32_t ipf = 0;
+  for (int i = 0; i < 4; i++) {
+    ipf |= (uint32_t)header[16 + i] << (8 * i);
+  }
+  Movie* movie = ipf ? movie_create(seed, ipf, header[5]) : NULL;
+  if (!movie) {
+    fclose(fp);
+    return NULL;
+  }
+
+  uint8_t frame[2];
+  while (fread(frame, 1, sizeof(frame), fp) == sizeof(frame)) {
+    if (movie_append(movie, frame[0] | (frame[1] << 8))) {
+      movie_destroy(movie);
+      fclose(fp);
+      return NULL;
+    }
+  }
+  fclose(fp);
+  return movie;
+}
@@ -0,0 +1,36 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Input movie, the keys held in every frame of a session plus what is
+// needed to start the machine the same way. Replaying it from a fresh
+// machine reproduces the session exactly.
+//
+// File: "C8MV", u8 version, u8 quirks, u16 reserved, u64 seed, u32
+// instructions per frame, then a u16 key mask per frame until the end of
+// the file. All values are little-endian.
+#define MOVIE_VERSION 1
+#define MOVIE_HEADER_SIZE 20
+
+typedef struct {
+  uint64_t seed; // random seed of the machine
+  long ipf; // instructions per frame, timers tick after every frame
+  uint8_t quirks; // CHIP8_QUIRK_* flags
+  long frames;
+  long capacity;
+  uint16_t* keys; // bit i set while CHIP-8 key i is held, one mask per frame
+} Movie;
+
+Movie* movie_create(uint64_t seed, long ipf, uint8_t quirks);
+void movie_destroy(Movie* movie);
+// Records the keys of the next frame, returns 1 when out of memory
+int movie_append(Movie* movie, uint16_t keys);
+// Drops the frames after the first frames, used when rewinding
+void movie_truncate(Movie* movie, long frames);
+int movie_save(const Movie* movie, const char* filename);
+// Returns NULL when the file can not be read or is not a movie
+Movie* movie_load(const char* filename);
+
+#endif
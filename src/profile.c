@@ -0,0 +1,228 @@
+#define _POSIX_C_SOURCE 200809L // Needed for clock_gettime
+
+#include "profile.h"
+#include "chip8.h"
+
+#ifdef CHIP8_PROFILE
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+  uint16_t mask;
+  uint16_t value;
+  const char* name;
+} OpcodeClass;
+
+// First match wins, the last entry catches everything else
+static const OpcodeClass classes[] = {
+  {0xFFFF, 0x00E0, "CLS"},
+  {0xFFFF, 0x00EE, "RET"},
+  {0xFFF0, 0x00C0, "SCD"},
+  {0xFFF0, 0x00D0, "SCU"},
+  {0xFFFF, 0x00FB, "SCR"},
+  {0xFFFF, 0x00FC, "SCL"},
+  {0xFFFF, 0x00FD, "EXIT"},
+  {0xFFFF, 0x00FE, "LOW"},
+  {0xFFFF, 0x00FF, "HIGH"},
+  {0xF000, 0x1000, "JP addr"},
+  {0xF000, 0x2000, "CALL addr"},
+  {0xF000, 0x3000, "SE Vx, byte"},
+  {0xF000, 0x4000, "SNE Vx, byte"},
+  {0xF00F, 0x5000, "SE Vx, Vy"},
+  {0xF00F, 0x5002, "LD [I], Vx-Vy"},
+  {0xF00F, 0x5003, "LD Vx-Vy, [I]"},
+  {0xF000, 0x6000, "LD Vx, byte"},
+  {0xF000, 0x7000, "ADD Vx, byte"},
+  {0xF00F, 0x8000, "LD Vx, Vy"},
+  {0xF00F, 0x8001, "OR Vx, Vy"},
+  {0xF00F, 0x8002, "AND Vx, Vy"},
+  {0xF00F, 0x8003, "XOR Vx, Vy"},
+  {0xF00F, 0x8004, "ADD Vx, Vy"},
+  {0xF00F, 0x8005, "SUB Vx, Vy"},
+  {0xF00F, 0x8006, "SHR Vx"},
+  {0xF00F, 0x8007, "SUBN Vx, Vy"},
+  {0xF00F, 0x800E, "SHL Vx"},
+  {0xF00F, 0x9000, "SNE Vx, Vy"},
+  {0xF000, 0xA000, "LD I, addr"},
+  {0xF000, 0xB000, "JP V0, addr"},
+  {0xF000, 0xC000, "RND Vx, byte"},
+  {0xF00F, 0xD000, "DRW Vx, Vy, 0"},
+  {0xF000, 0xD000, "DRW Vx, Vy, n"},
+  {0xF0FF, 0xE09E, "SKP Vx"},
+  {0xF0FF, 0xE0A1, "SKNP Vx"},
+  {0xFFFF, 0xF000, "LD I, long"},
+  {0xFFFF, 0xF002, "AUDIO"},
+  {0xF0FF, 0xF001, "PLANE n"},
+  {0xF0FF, 0xF007, "LD Vx, DT"},
+  {0xF0FF, 0xF00A, "LD Vx, K"},
+  {0xF0FF, 0xF015, "LD DT, Vx"},
+  {0xF0FF, 0xF018, "LD ST, Vx"},
+  {0xF0FF, 0xF01E, "ADD I, Vx"},
+  {0xF0FF, 0xF029, "LD F, Vx"},
+  {0xF0FF, 0xF030, "LD HF, Vx"},
+  {0xF0FF, 0xF033, "LD B, Vx"},
+  {0xF0FF, 0xF03A, "PITCH Vx"},
+  {0xF0FF, 0xF055, "LD [I], Vx"},
+  {0xF0FF, 0xF065, "LD Vx, [I]"},
+  {0xF0FF, 0xF075, "LD R, Vx"},
+  {0xF0FF, 0xF085, "LD Vx, R"},
+  {0x0000, 0x0000, "unknown"}
+};
+
+#define CLASS_COUNT (sizeof(classes) / sizeof(classes[0]))
+
+// Counters for the whole process, exact as long as one thread steps
+static uint8_t class_of[0x10000]; // opcode to index in classes
+static int class_table_ready = 0;
+static uint64_t class_counts[CLASS_COUNT];
+static uint64_t address_counts[MEMORY_SIZE];
+static uint64_t draw_calls = 0;
+static uint64_t draw_pixels = 0;
+static uint64_t key_wait_executions = 0;
+static uint64_t key_wait_ns = 0;
+static uint64_t key_wait_since = 0; // start of the current wait, 0 when not waiting
+
+static void build_class_table();
+static uint64_t now_ns();
+
+
+void profile_instruction(uint16_t pc, uint16_t opcode) {
+  if (!class_table_ready) {
+    build_class_table();
+  }
+  class_counts[class_of[opcode]]++;
+  address_counts[pc]++;
+}
+
+void profile_draw(int pixels) {
+  draw_calls++;
+  draw_pixels += pixels;
+}
+
+void profile_key_wait(int blocked) {
+  // Time runs from the first blocked execution to the one that gets a key
+  if (blocked) {
+    key_wait_executions++;
+    if (!key_wait_since) {
+      key_wait_since = now_ns();
+    }
+  } else if (key_wait_since) {
+    key_wait_ns += now_ns() - key_wait_since;
+    key_wait_since = 0;
+  }
+}
+
+void profile_reset() {
+  memset(class_counts, 0, sizeof(class_counts));
+  memset(address_counts, 0, sizeof(address_counts));
+  draw_calls = 0;
+  draw_pixels = 0;
+  key_wait_executions = 0;
+  key_wait_ns = 0;
+  key_wait_since = 0;
+}
+
+int profile_report(FILE* text, const char* json_filename) {
+  assert(text);
+  assert(json_filename);
+
+  // A wait still going on counts up to now
+  uint64_t waited = key_wait_ns;
+  if (key_wait_since) {
+    waited += now_ns() - key_wait_since;
+  }
+  uint64_t total = 0;
+  for (size_t i = 0; i < CLASS_COUNT; i++) {
+    total += class_counts[i];
+  }
+
+  fprintf(text, "Profile: %llu instructions\n", (unsigned long long)total);
+  for (size_t i = 0; i < CLASS_COUNT; i++) {
+    if (class_counts[i]) {
+      fprintf(text, "  %-16s %14llu %6.2f%%\n", classes[i].name,
+              (unsigned long long)class_counts[i], 100.0 * class_counts[i] / total);
+    }
+  }
+
+  // Selection of the hottest addresses, a few passes over 64K counters
+  fprintf(text, "Hot addresses:\n");
+  uint64_t limit = UINT64_MAX;
+  int listed = 0;
+  while (listed < PROFILE_TOP_ADDRESSES) {
+    uint64_t best = 0;
+    for (int pc = 0; pc < MEMORY_SIZE; pc++) {
+      if (address_counts[pc] < limit && address_counts[pc] > best) {
+        best = address_counts[pc];
+      }
+    }
+    if (!best) {
+      break;
+    }
+    for (int pc = 0; pc < MEMORY_SIZE && listed < PROFILE_TOP_ADDRESSES; pc++) {
+      if (address_counts[pc] == best) {
+        fprintf(text, "  %04X %14llu %6.2f%%\n", pc, (unsigned long long)best, 100.0 * best / total);
+        listed++;
+      }
+    }
+    limit = best;
+  }
+  fprintf(text, "DRW: %llu calls, %llu pixels\n",
+          (unsigned long long)draw_calls, (unsigned long long)draw_pixels);
+  fprintf(text, "LD Vx, K: %llu blocked executions, %.3f s waiting\n",
+          (unsigned long long)key_wait_executions, waited / 1e9);
+
+  FILE* fp = fopen(json_filename, "w");
+  if (!fp) {
+    return 1;
+  }
+  fprintf(fp, "{\"instructions\":%llu,\"classes\":{", (unsigned long long)total);
+  int first = 1;
+  for (size_t i = 0; i < CLASS_COUNT; i++) {
+    if (class_counts[i]) {
+      fprintf(fp, "%s\"%s\":%llu", first ? "" : ",", classes[i].name, (unsigned long long)class_counts[i]);
+      first = 0;
+    }
+  }
+  fprintf(fp, "},\"addresses\":[");
+  first = 1;
+  for (int pc = 0; pc < MEMORY_SIZE; pc++) {
+    if (address_counts[pc]) {
+      fprintf(fp, "%s{\"pc\":%d,\"count\":%llu}", first ? "" : ",", pc, (unsigned long long)address_counts[pc]);
+      first = 0;
+    }
+  }
+  fprintf(fp, "],\"draw\":{\"calls\":%llu,\"pixels\":%llu}",
+          (unsigned long long)draw_calls, (unsigned long long)draw_pixels);
+  fprintf(fp, ",\"key_wait\":{\"executions\":%llu,\"seconds\":%.6f}}\n",
+          (unsigned long long)key_wait_executions, waited / 1e9);
+  int failed = ferror(fp);
+  fclose(fp);
+  return failed ? 1 : 0;
+}
+
+// ----------------------------------------------------------------------------
+// Static functions
+// ----------------------------------------------------------------------------
+
+static void build_class_table() {
+  for (uint32_t opcode = 0; opcode < 0x10000; opcode++) {
+    size_t i = 0;
+    while ((opcode & classes[i].mask) != classes[i].value) {
+      i++;
+    }
+    class_of[opcode] = i;
+  }
+  class_table_ready = 1;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Execution counters for finding the loops a ROM spends its time in, built
+// with make PROFILE=1. Counts executions per instruction class and per
+// address, pixels flipped by DRW and time spent waiting in Fx0A. The
+// counters are global and not atomic, profile one instance at a time.
+//
+// Without CHIP8_PROFILE the hooks below expand to nothing.
+
+#define PROFILE_JSON_FILE "chip8-profile.json"
+#define PROFILE_TOP_ADDRESSES 20 // hottest addresses listed in the text report
+
+#ifdef CHIP8_PROFILE
+
+#define PROFILE_INSTRUCTION(pc, opcode) profile_instruction(pc, opcode)
+#define PROFILE_DRAW(pixels) profile_draw(pixels)
+#define PROFILE_KEY_WAIT(blocked) profile_key_wait(blocked)
+
+void profile_instruction(uint16_t pc, uint16_t opcode);
+void profile_draw(int pixels);
+void profile_key_wait(int blocked);
+void profile_reset();
+// Writes the text report to text and the full counters as JSON to
+// json_filename, returns 1 when the JSON file can not be written
+int profile_report(FILE* text, const char* json_filename);
+
+#else
+
+#define PROFILE_INSTRUCTION(pc, opcode) ((void)0)
+#define PROFILE_DRAW(pixels) ((void)0)
+#define PROFILE_KEY_WAIT(blocked) ((void)0)
+
+#endif
+
+#endif
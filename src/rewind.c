@@ -0,0 +1,252 @@
+#include "rewind.h"
+#include "chip8.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RUN_HEADER_SIZE 6 // u32 offset, u16 length
+#define RUN_MAX_LENGTH 0xFFFF
+#define RUN_MERGE_GAP 6 // unchanged bytes cheaper to copy than to start a new run
+#define SCAN_CHUNK 64 // unchanged stretches are skipped this many bytes at a time
+
+// Deltas are a list of runs, each holding the XOR of the changed bytes with
+// the previous frame. XOR works both ways, so the newest frame can be undone
+// without going back to a keyframe.
+typedef struct {
+  uint32_t offset; // position of the payload in data
+  uint32_t size;
+  uint8_t keyframe;
+} Entry;
+
+struct RewindBuffer {
+  uint8_t* data; // payloads, written as a ring
+  size_t capacity;
+  Entry* entries; // ring of entries, oldest first
+  int max_frames;
+  int first;
+  int count;
+  int keyframe_interval;
+  int since_keyframe; // deltas pushed since the last keyframe
+  uint8_t newest[CHIP8_STATE_SIZE]; // state of the newest entry
+  uint8_t current[CHIP8_STATE_SIZE];
+  uint8_t encoded[CHIP8_STATE_SIZE];
+};
+
+static int encode_delta(const uint8_t* previous, const uint8_t* current, uint8_t* out);
+static void apply_delta(uint8_t* state, const uint8_t* delta, size_t size);
+static Entry* entry_at(RewindBuffer* buffer, int index);
+static size_t allocate(RewindBuffer* buffer, size_t size);
+static void drop_oldest(RewindBuffer* buffer);
+
+
+RewindBuffer* rewind_buffer_create(size_t capacity, int max_frames, int keyframe_interval) {
+  assert(capacity >= CHIP8_STATE_SIZE);
+  assert(max_frames > 0);
+  assert(keyframe_interval > 0);
+
+  RewindBuffer* buffer = calloc(1, sizeof(RewindBuffer));
+  if (!buffer) {
+    return NULL;
+  }
+  buffer->data = malloc(capacity);
+  buffer->entries = malloc(max_frames * sizeof(Entry));
+  if (!buffer->data || !buffer->entries) {
+    free(buffer->data);
+    free(buffer->entries);
+    free(buffer);
+    return NULL;
+  }
+  buffer->capacity = capacity;
+  buffer->max_frames = max_frames;
+  buffer->keyframe_interval = keyframe_interval;
+  return buffer;
+}
+
+void rewind_buffer_destroy(RewindBuffer* buffer) {
+  if (!buffer) {
+    return;
+  }
+  free(buffer->data);
+  free(buffer->entries);
+  free(buffer);
+}
+
+int rewind_buffer_frames(RewindBuffer* buffer) {
+  assert(buffer);
+  return buffer->count;
+}
+
+void rewind_buffer_push(RewindBuffer* buffer, const Chip8* chip) {
+  assert(buffer);
+  assert(chip);
+
+  chip8_save_state(chip, buffer->current, CHIP8_STATE_SIZE);
+
+  const uint8_t* payload = buffer->current;
+  size_t size = CHIP8_STATE_SIZE;
+  int keyframe = 1;
+  if (buffer->count && buffer->since_keyframe + 1 < buffer->keyframe_interval) {
+    int delta_size = encode_delta(buffer->newest, buffer->current, buffer->encoded);
+    if (delta_size >= 0) {
+      payload = buffer->encoded;
+      size = delta_size;
+      keyframe = 0;
+    }
+  }
+
+  size_t offset = allocate(buffer, size);
+  if (!keyframe && !buffer->count) {
+    // Making room dropped the frame the delta was based on
+    payload = buffer->current;
+    size = CHIP8_STATE_SIZE;
+    keyframe = 1;
+    offset = allocate(buffer, size);
+  }
+
+  memcpy(buffer->data + offset, payload, size);
+  Entry* entry = entry_at(buffer, buffer->count);
+  entry->offset = offset;
+  entry->size = size;
+  entry->keyframe = keyframe;
+  buffer->count++;
+  buffer->since_keyframe = keyframe ? 0 : buffer->since_keyframe + 1;
+  memcpy(buffer->newest, buffer->current, CHIP8_STATE_SIZE);
+}
+
+int rewind_buffer_step_back(RewindBuffer* buffer, Chip8* chip) {
+  assert(buffer);
+  assert(chip);
+
+  if (buffer->count == 0) {
+    return 1;
+  }
+  if (buffer->count == 1) {
+    chip8_load_state(chip, buffer->newest, CHIP8_STATE_SIZE);
+    return 1;
+  }
+
+  Entry* dropped = entry_at(buffer, buffer->count - 1);
+  buffer->count--;
+  if (!dropped->keyframe) {
+    // Undo the newest delta
+    apply_delta(buffer->newest, buffer->data + dropped->offset, dropped->size);
+    buffer->since_keyframe--;
+  } else {
+    // Rebuild from the closest keyframe before it
+    int key = buffer->count - 1;
+    while (!entry_at(buffer, key)->keyframe) {
+      key--;
+    }
+    Entry* entry = entry_at(buffer, key);
+    memcpy(buffer->newest, buffer->data + entry->offset, CHIP8_STATE_SIZE);
+    for (int i = key + 1; i < buffer->count; i++) {
+      entry = entry_at(buffer, i);
+      apply_delta(buffer->newest, buffer->data + entry->offset, entry->size);
+    }
+    buffer->since_keyframe = buffer->count - 1 - key;
+  }
+
+  chip8_load_state(chip, buffer->newest, CHIP8_STATE_SIZE);
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Static functions
+// ----------------------------------------------------------------------------
+
+static int encode_delta(const uint8_t* previous, const uint8_t* current, uint8_t* out) {
+  // Returns the encoded size, -1 when a keyframe would be smaller
+  int size = 0;
+  int i = 0;
+  while (i < CHIP8_STATE_SIZE) {
+    // Most of the state, memory above all, does not change between frames
+    if (i + SCAN_CHUNK <= CHIP8_STATE_SIZE && !memcmp(previous + i, current + i, SCAN_CHUNK)) {
+      i += SCAN_CHUNK;
+      continue;
+    }
+    if (previous[i] == current[i]) {
+      i++;
+      continue;
+    }
+
+    // Extend the run over short stretches of unchanged bytes
+    int start = i;
+    int end = i + 1;
+    int same = 0;
+    for (int j = end; j < CHIP8_STATE_SIZE && same <= RUN_MERGE_GAP && j - start < RUN_MAX_LENGTH; j++) {
+      if (previous[j] != current[j]) {
+        end = j + 1;
+        same = 0;
+      } else {
+        same++;
+      }
+    }
+
+    int length = end - start;
+    if (size + RUN_HEADER_SIZE + length >= CHIP8_STATE_SIZE) {
+      return -1;
+    }
+    out[size++] = start & 0xFF;
+    out[size++] = (start >> 8) & 0xFF;
+    out[size++] = (start >> 16) & 0xFF;
+    out[size++] = start >> 24;
+    out[size++] = length & 0xFF;
+    out[size++] = length >> 8;
+    for (int j = start; j < end; j++) {
+      out[size++] = previous[j] ^ current[j];
+    }
+    i = end;
+  }
+  return size;
+}
+
+static void apply_delta(uint8_t* state, const uint8_t* delta, size_t size) {
+  size_t i = 0;
+  while (i < size) {
+    int start = delta[i] | (delta[i + 1] << 8) | (delta[i + 2] << 16) | (delta[i + 3] << 24);
+    int length = delta[i + 4] | (delta[i + 5] << 8);
+    i += RUN_HEADER_SIZE;
+    for (int j = 0; j < length; j++) {
+      state[start + j] ^= delta[i + j];
+    }
+    i += length;
+  }
+}
+
+static Entry* entry_at(RewindBuffer* buffer, int index) {
+  // index 0 is the oldest entry
+  return &buffer->entries[(buffer->first + index) % buffer->max_frames];
+}
+
+static size_t allocate(RewindBuffer* buffer, size_t size) {
+  // Payloads are laid out in push order, the bytes after the newest entry
+  // belong to the oldest ones
+  size_t offset = 0;
+  if (buffer->count) {
+    Entry* newest = entry_at(buffer, buffer->count - 1);
+    offset = newest->offset + newest->size;
+    if (offset + size > buffer->capacity) {
+      offset = 0;
+    }
+  }
+
+  while (buffer->count) {
+    Entry* oldest = entry_at(buffer, 0);
+    int overlaps = oldest->offset < offset + size && oldest->offset + oldest->size > offset;
+    if (!overlaps && buffer->count < buffer->max_frames) {
+      break;
+    }
+    drop_oldest(buffer);
+  }
+  return offset;
+}
+
+static void drop_oldest(RewindBuffer* buffer) {
+  // Deltas left without the keyframe they build on are dropped as well
+  do {
+    buffer->first = (buffer->first + 1) % buffer->max_frames;
+    buffer->count--;
+  } while (buffer->count && !entry_at(buffer, 0)->keyframe);
+}
@@ -0,0 +1,22 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "chip8.h"
+
+#include <stddef.h>
+
+// Fixed size history of save states, one per frame. Most entries only hold
+// the bytes that changed since the previous frame, a full keyframe is stored
+// every keyframe_interval frames. The oldest frames are dropped when full.
+typedef struct RewindBuffer RewindBuffer;
+
+RewindBuffer* rewind_buffer_create(size_t capacity, int max_frames, int keyframe_interval);
+void rewind_buffer_destroy(RewindBuffer* buffer);
+// Records the state of the current frame
+void rewind_buffer_push(RewindBuffer* buffer, const Chip8* chip);
+// Drops the newest frame and restores the one before it, returns 1 when
+// there is no older frame to go back to
+int rewind_buffer_step_back(RewindBuffer* buffer, Chip8* chip);
+int rewind_buffer_frames(RewindBuffer* buffer);
+
+#endif
@@ -0,0 +1,41 @@
+#define _POSIX_C_SOURCE 200809L // Needed for clock_gettime
+
+#include "scheduler.h"
+
+#include <assert.h>
+#include <time.h>
+
+
+uint64_t time_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void scheduler_init(Scheduler* scheduler, long ipf) {
+  assert(scheduler);
+  assert(ipf >= 0);
+  scheduler->ipf = ipf;
+  scheduler_reset(scheduler, time_now_ns());
+}
+
+void scheduler_reset(Scheduler* scheduler, uint64_t now) {
+  assert(scheduler);
+  scheduler->next_frame = now + SCHEDULER_FRAME_NS;
+}
+
+int scheduler_frames_due(Scheduler* scheduler, uint64_t now) {
+  assert(scheduler);
+  if (now < scheduler->next_frame) {
+    return 0;
+  }
+
+  uint64_t frames = (now - scheduler->next_frame) / SCHEDULER_FRAME_NS + 1;
+  if (frames > SCHEDULER_MAX_CATCH_UP) {
+    // Too far behind to catch up, drop the missed frames
+    scheduler_reset(scheduler, now);
+    return SCHEDULER_MAX_CATCH_UP;
+  }
+  scheduler->next_frame += frames * SCHEDULER_FRAME_NS;
+  return (int)frames;
+}
@@ -0,0 +1,25 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#define SCHEDULER_FRAME_NS (1000000000ULL / 60) // 60Hz
+#define SCHEDULER_MAX_CATCH_UP 6 // frames run back to back after a stall
+
+// Paces emulation in 60Hz frames on the monotonic clock. Each frame runs a
+// fixed number of instructions, frames missed during a stall are run back
+// to back up to a limit, after that the schedule restarts from now.
+typedef struct {
+  long ipf; // instructions per frame, 0 runs as many as fit in the frame
+  uint64_t next_frame; // deadline of the next frame in ns
+} Scheduler;
+
+uint64_t time_now_ns();
+
+void scheduler_init(Scheduler* scheduler, long ipf);
+// Starts the schedule over, the next frame is due one frame from now
+void scheduler_reset(Scheduler* scheduler, uint64_t now);
+// Number of frames that are due and advances the schedule past them
+int scheduler_frames_due(Scheduler* scheduler, uint64_t now);
+
+#endif
@@ -0,0 +1,280 @@
+#define _POSIX_C_SOURCE 200809L // Needed for mmap
+
+#include "trace.h"
+#include "chip8.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WRITE_BUFFER_SIZE (64 * 1024)
+
+struct TraceWriter {
+  FILE* fp;
+  size_t used;
+  int failed; // a write came up short
+  uint8_t buffer[WRITE_BUFFER_SIZE];
+};
+
+struct TraceReader {
+  const uint8_t* data; // whole file, mapped read only
+  size_t size;
+  size_t position; // next record
+  size_t state_size;
+};
+
+static uint16_t memory_written(const Chip8* chip, uint16_t opcode, uint16_t* address);
+static void flush(TraceWriter* writer);
+static uint8_t* put_u16(uint8_t* p, uint16_t value);
+static uint16_t get_u16(const uint8_t* p);
+
+
+TraceWriter* trace_writer_open(const char* filename, const Chip8* chip) {
+  assert(filename);
+  assert(chip);
+
+  TraceWriter* writer = malloc(sizeof(TraceWriter));
+  if (!writer) {
+    return NULL;
+  }
+  writer->fp = fopen(filename, "wb");
+  if (!writer->fp) {
+    free(writer);
+    return NULL;
+  }
+  writer->used = 0;
+  writer->failed = 0;
+
+  uint8_t header[TRACE_HEADER_SIZE] = {'C', '8', 'T', 'R', TRACE_VERSION, 0, 0, 0};
+  for (int i = 0; i < 4; i++) {
+    header[8 + i] = (CHIP8_STATE_SIZE >> (8 * i)) & 0xFF;
+  }
+  static uint8_t state[CHIP8_STATE_SIZE];
+  chip8_save_state(chip, state, sizeof(state));
+  if (fwrite(header, 1, sizeof(header), writer->fp) != sizeof(header)
+      || fwrite(state, 1, sizeof(state), writer->fp) != sizeof(state)) {
+    fclose(writer->fp);
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+void trace_writer_step(TraceWriter* writer, Chip8* chip) {
+  assert(writer);
+  assert(chip);
+
+  uint16_t pc = chip->PC;
+  uint16_t opcode = (chip->memory[pc] << 8) | chip->memory[(uint16_t)(pc + 1)];
+  uint16_t address;
+  uint16_t length = memory_written(chip, opcode, &address);
+  uint8_t registers[REGISTERS_SIZE];
+  memcpy(registers, chip->registers, REGISTERS_SIZE);
+  uint16_t I = chip->I;
+
+  chip8_step(chip);
+
+  if (WRITE_BUFFER_SIZE - writer->used < TRACE_RECORD_MAX_SIZE) {
+    flush(writer);
+  }
+  uint8_t* record = writer->buffer + writer->used;
+  uint8_t* p = record + 1;
+  uint8_t flags = 0;
+  p = put_u16(p, pc);
+  p = put_u16(p, opcode);
+
+  uint16_t mask = 0;
+  for (int i = 0; i < REGISTERS_SIZE; i++) {
+    if (chip->registers[i] != registers[i]) {
+      mask |= 1 << i;
+    }
+  }
+  if (mask) {
+    flags |= TRACE_REGISTERS;
+    p = put_u16(p, mask);
+    for (int i = 0; i < REGISTERS_SIZE; i++) {
+      if (mask & (1 << i)) {
+        *p++ = chip->registers[i];
+      }
+    }
+  }
+  if (chip->I != I) {
+    flags |= TRACE_I;
+    p = put_u16(p, chip->I);
+  }
+  if (length) {
+    flags |= TRACE_MEMORY;
+    p = put_u16(p, address);
+    *p++ = length;
+    for (int i = 0; i < length; i++) {
+      *p++ = chip->memory[(uint16_t)(address + i)];
+    }
+  }
+
+  record[0] = flags;
+  writer->used = p - writer->buffer;
+}
+
+int trace_writer_close(TraceWriter* writer) {
+  if (!writer) {
+    return 0;
+  }
+  flush(writer);
+  int failed = writer->failed || fclose(writer->fp) != 0;
+  free(writer);
+  return failed ? 1 : 0;
+}
+
+TraceReader* trace_reader_open(const char* filename) {
+  assert(filename);
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < TRACE_HEADER_SIZE) {
+    close(fd);
+    return NULL;
+  }
+  size_t size = st.st_size;
+  void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  const uint8_t* header = data;
+  size_t state_size = 0;
+  for (int i = 0; i < 4; i++) {
+    state_size |= (size_t)header[8 + i] << (8 * i);
+  }
+  TraceReader* reader = malloc(sizeof(TraceReader));
+  if (!reader || memcmp(header, "C8TR", 4) || header[4] != TRACE_VERSION
+      || state_size > size - TRACE_HEADER_SIZE) {
+    free(reader);
+    munmap(data, size);
+    return NULL;
+  }
+  reader->data = data;
+  reader->size = size;
+  reader->state_size = state_size;
+  reader->position = TRACE_HEADER_SIZE + state_size;
+  return reader;
+}
+
+void trace_reader_close(TraceReader* reader) {
+  if (!reader) {
+    return;
+  }
+  munmap((void*)reader->data, reader->size);
+  free(reader);
+}
+
+const uint8_t* trace_reader_state(TraceReader* reader, size_t* size) {
+  assert(reader);
+  assert(size);
+  *size = reader->state_size;
+  return reader->data + TRACE_HEADER_SIZE;
+}
+
+int trace_reader_next(TraceReader* reader, TraceRecord* record) {
+  assert(reader);
+  assert(record);
+
+  size_t left = reader->size - reader->position;
+  if (!left) {
+    return 1;
+  }
+  const uint8_t* start = reader->data + reader->position;
+  const uint8_t* end = start + left;
+  const uint8_t* p = start;
+  if (left < 5) {
+    return 2;
+  }
+  record->flags = p[0];
+  record->pc = get_u16(p + 1);
+  record->opcode = get_u16(p + 3);
+  p += 5;
+
+  record->register_mask = 0;
+  if (record->flags & TRACE_REGISTERS) {
+    if (end - p < 2) {
+      return 2;
+    }
+    record->register_mask = get_u16(p);
+    p += 2;
+    for (int i = 0; i < REGISTERS_SIZE; i++) {
+      if (!(record->register_mask & (1 << i))) {
+        continue;
+      }
+      if (p == end) {
+        return 2;
+      }
+      record->registers[i] = *p++;
+    }
+  }
+  if (record->flags & TRACE_I) {
+    if (end - p < 2) {
+      return 2;
+    }
+    record->I = get_u16(p);
+    p += 2;
+  }
+  record->length = 0;
+  if (record->flags & TRACE_MEMORY) {
+    if (end - p < 3 || end - p < 3 + p[2]) {
+      return 2;
+    }
+    record->address = get_u16(p);
+    record->length = p[2];
+    record->bytes = p + 3;
+    p += 3 + record->length;
+  }
+
+  reader->position += p - start;
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Static functions
+// ----------------------------------------------------------------------------
+
+static uint16_t memory_written(const Chip8* chip, uint16_t opcode, uint16_t* address) {
+  // Bytes the instruction stores starting at I, the same ones the JIT
+  // invalidates
+  *address = chip->I;
+  if ((opcode & 0xF0FF) == 0xF033) {
+    return 3;
+  } else if ((opcode & 0xF0FF) == 0xF055) {
+    return ((opcode & 0x0F00) >> 8) + 1;
+  } else if ((opcode & 0xF00F) == 0x5002) {
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+    return ((x <= y) ? y - x : x - y) + 1;
+  }
+  return 0;
+}
+
+static void flush(TraceWriter* writer) {
+  if (writer->used && fwrite(writer->buffer, 1, writer->used, writer->fp) != writer->used) {
+    writer->failed = 1;
+  }
+  writer->used = 0;
+}
+
+static uint8_t* put_u16(uint8_t* p, uint16_t value) {
+  p[0] = value & 0xFF;
+  p[1] = value >> 8;
+  return p + 2;
+}
+
+static uint16_t get_u16(const uint8_t* p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
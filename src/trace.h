@@ -0,0 +1,60 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "chip8.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary execution trace, one record per executed instruction.
+//
+// File: "C8TR", u8 version, 3 reserved bytes, u32 size of the save state
+// that follows (the machine before the first record), then records until
+// the end of the file. All values are little-endian.
+//
+// Record: u8 flags, u16 PC, u16 opcode, then for each flag that is set
+//   TRACE_REGISTERS  u16 mask of changed registers, new value of each
+//   TRACE_I          u16 new I
+//   TRACE_MEMORY     u16 address, u8 length, bytes written
+//
+// Records only hold what changed, so traces compress well and a file can
+// be mapped and walked without parsing the whole thing first.
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 12
+#define TRACE_RECORD_MAX_SIZE (5 + 2 + REGISTERS_SIZE + 2 + 3 + REGISTERS_SIZE)
+
+#define TRACE_REGISTERS 0x01
+#define TRACE_I 0x02
+#define TRACE_MEMORY 0x04
+
+typedef struct {
+  uint8_t flags;
+  uint16_t pc;
+  uint16_t opcode;
+  uint16_t register_mask;
+  uint8_t registers[REGISTERS_SIZE]; // new values of the registers in the mask
+  uint16_t I;
+  uint16_t address; // first byte written
+  uint8_t length; // bytes written
+  const uint8_t* bytes; // points into the mapped file
+} TraceRecord;
+
+typedef struct TraceWriter TraceWriter;
+typedef struct TraceReader TraceReader;
+
+// Creates the file and writes the header with the state of chip
+TraceWriter* trace_writer_open(const char* filename, const Chip8* chip);
+// Executes one instruction and records it
+void trace_writer_step(TraceWriter* writer, Chip8* chip);
+// Flushes and closes the file, returns 1 when any write failed
+int trace_writer_close(TraceWriter* writer);
+
+TraceReader* trace_reader_open(const char* filename);
+void trace_reader_close(TraceReader* reader);
+// Save state stored in the header
+const uint8_t* trace_reader_state(TraceReader* reader, size_t* size);
+// Reads the next record, returns 1 at the end of the trace and 2 when the
+// last record is cut short
+int trace_reader_next(TraceReader* reader, TraceRecord* record);
+
+#endif
@@ -0,0 +1,121 @@
+#define _POSIX_C_SOURCE 200809L // Needed for getopt
+
+#include "chip8.h"
+#include "trace.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+  long skip; // records left out at the start
+  long count; // records printed, 0 for all of them
+  int summary; // only print the totals
+  const char* filename;
+} Options;
+
+static int parse_options(int argc, char* argv[], Options* options);
+static void print_record(long index, const TraceRecord* record);
+
+
+int main(int argc, char* argv[]) {
+  Options options = {
+    .skip = 0,
+    .count = 0,
+    .summary = 0,
+    .filename = NULL
+  };
+  if (parse_options(argc, argv, &options)) {
+    printf("Usage: %s [-k records to skip] [-n records] [-s] <trace file>\n", argv[0]);
+    return 0;
+  }
+
+  TraceReader* reader = trace_reader_open(options.filename);
+  if (!reader) {
+    printf("Failed to open trace: %s\n", options.filename);
+    return -1;
+  }
+
+  static Chip8 chip;
+  size_t state_size;
+  const uint8_t* state = trace_reader_state(reader, &state_size);
+  chip8_init(&chip);
+  if (chip8_load_state(&chip, state, state_size)) {
+    printf("Unsupported start state in trace: %s\n", options.filename);
+    trace_reader_close(reader);
+    return -1;
+  }
+  if (!options.summary) {
+    printf("Start PC:%04X I:%04X SP:%02X\n", chip.PC, chip.I, chip.SP);
+  }
+
+  TraceRecord record;
+  long index = 0;
+  long memory_writes = 0;
+  int result;
+  while ((result = trace_reader_next(reader, &record)) == 0) {
+    if (record.flags & TRACE_MEMORY) {
+      memory_writes++;
+    }
+    if (!options.summary && index >= options.skip
+        && (!options.count || index < options.skip + options.count)) {
+      print_record(index, &record);
+    }
+    index++;
+  }
+  trace_reader_close(reader);
+
+  printf("%ld instructions, %ld memory writes\n", index, memory_writes);
+  if (result == 2) {
+    printf("Trace ends in the middle of a record\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+static int parse_options(int argc, char* argv[], Options* options) {
+  assert(options);
+  int opt;
+  while ((opt = getopt(argc, argv, "k:n:s")) != -1) {
+    switch (opt) {
+      case 'k':
+        options->skip = atol(optarg);
+        break;
+      case 'n':
+        options->count = atol(optarg);
+        break;
+      case 's':
+        options->summary = 1;
+        break;
+      default:
+        return 1;
+    }
+  }
+  if (optind != argc - 1 || options->skip < 0 || options->count < 0) {
+    return 1;
+  }
+  options->filename = argv[optind];
+  return 0;
+}
+
+static void print_record(long index, const TraceRecord* record) {
+  printf("%10ld %04X %04X", index, record->pc, record->opcode);
+  for (int i = 0; i < REGISTERS_SIZE; i++) {
+    if (record->register_mask & (1 << i)) {
+      printf(" V%X=%02X", i, record->registers[i]);
+    }
+  }
+  if (record->flags & TRACE_I) {
+    printf(" I=%04X", record->I);
+  }
+  if (record->flags & TRACE_MEMORY) {
+    printf(" [%04X]=", record->address);
+    for (int i = 0; i < record->length; i++) {
+      printf("%02X", record->bytes[i]);
+    }
+  }
+  printf("\n");
+}
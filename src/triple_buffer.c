@@ -0,0 +1,46 @@
+#include "triple_buffer.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define TRIPLE_BUFFER_INDEX 0x3
+#define TRIPLE_BUFFER_FRESH 0x4 // middle holds a frame the reader has not taken
+
+
+void triple_buffer_init(TripleBuffer* buffer) {
+  assert(buffer);
+  memset(buffer->frames, 0, sizeof(buffer->frames));
+  buffer->back = 0;
+  buffer->middle = 1;
+  buffer->front = 2;
+  buffer->unseen = 0;
+}
+
+Frame* triple_buffer_back(TripleBuffer* buffer) {
+  assert(buffer);
+  return &buffer->frames[buffer->back];
+}
+
+void triple_buffer_publish(TripleBuffer* buffer) {
+  assert(buffer);
+  // The reader gets every row changed since the last frame it took, rows of
+  // a frame it already took come along at worst and are compared away
+  Frame* frame = &buffer->frames[buffer->back];
+  uint64_t rows = frame->dirty_rows;
+  frame->dirty_rows = buffer->unseen | rows;
+  int old = __atomic_exchange_n(&buffer->middle, buffer->back | TRIPLE_BUFFER_FRESH, __ATOMIC_ACQ_REL);
+  buffer->back = old & TRIPLE_BUFFER_INDEX;
+  // A fresh middle was dropped, its rows are still unseen. Otherwise the
+  // reader took the previous frame and only the new one is unseen.
+  buffer->unseen = (old & TRIPLE_BUFFER_FRESH) ? buffer->unseen | rows : rows;
+}
+
+Frame* triple_buffer_take(TripleBuffer* buffer) {
+  assert(buffer);
+  if (!(__atomic_load_n(&buffer->middle, __ATOMIC_ACQUIRE) & TRIPLE_BUFFER_FRESH)) {
+    return NULL;
+  }
+  int old = __atomic_exchange_n(&buffer->middle, buffer->front, __ATOMIC_ACQ_REL);
+  buffer->front = old & TRIPLE_BUFFER_INDEX;
+  return &buffer->frames[buffer->front];
+}
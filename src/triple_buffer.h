@@ -0,0 +1,35 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include "chip8.h"
+
+#include <stdint.h>
+
+// A completed display frame
+typedef struct {
+  uint64_t pixels[DISPLAY_PLANES][DISPLAY_HEGIHT][ROW_WORDS];
+  uint8_t hires;
+  uint64_t dirty_rows; // rows changed, since the previous frame for the writer and
+                       // since the last frame taken for the reader
+} Frame;
+
+// Lock-free single writer, single reader frame exchange. The writer always
+// has a back buffer to fill, the reader always gets the newest published
+// frame, neither side ever waits for the other.
+typedef struct {
+  Frame frames[3];
+  int middle; // index of the exchanged buffer plus TRIPLE_BUFFER_FRESH, atomic
+  int back; // owned by the writer
+  int front; // owned by the reader
+  uint64_t unseen; // rows of published frames the reader may not have taken, owned by the writer
+} TripleBuffer;
+
+void triple_buffer_init(TripleBuffer* buffer);
+// Buffer the writer fills next, dirty_rows included
+Frame* triple_buffer_back(TripleBuffer* buffer);
+// Frames replaced before the reader took them pass their dirty rows on
+void triple_buffer_publish(TripleBuffer* buffer);
+// Newest published frame, NULL when nothing was published since the last call
+Frame* triple_buffer_take(TripleBuffer* buffer);
+
+#endif
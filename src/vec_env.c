@@ -0,0 +1,141 @@
+#include "vec_env.h"
+#include "chip8.h"
+#include "engine.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Chip8VecEnv {
+  Chip8Engine* engine;
+  int count;
+  uint8_t* rom; // copy for resets
+  size_t size;
+  uint8_t quirks;
+  long ipf;
+  uint16_t reward_address;
+  uint8_t* buffer; // observations of the step in progress
+};
+
+static void observe(void* context, int index, Chip8* chip);
+
+
+Chip8VecEnv* chip8_vec_env_create(int count, int thread_count, const uint8_t* rom, size_t size, uint64_t seed) {
+  assert(count > 0);
+  assert(rom);
+  assert(size > 0);
+
+  Chip8VecEnv* env = calloc(1, sizeof(Chip8VecEnv));
+  if (!env) {
+    return NULL;
+  }
+  env->count = count;
+  env->ipf = CHIP8_DEFAULT_IPF;
+  env->rom = malloc(size);
+  env->engine = chip8_engine_create(count, thread_count);
+  if (!env->rom || !env->engine) {
+    chip8_engine_destroy(env->engine);
+    free(env->rom);
+    free(env);
+    return NULL;
+  }
+  memcpy(env->rom, rom, size);
+  env->size = size;
+  for (int i = 0; i < count; i++) {
+    Chip8* chip = chip8_engine_instance(env->engine, i);
+    chip8_seed(chip, seed + i);
+    if (chip8_load_rom(chip, rom, size)) {
+      chip8_vec_env_destroy(env);
+      return NULL;
+    }
+  }
+  chip8_engine_set_done(env->engine, observe, env);
+  return env;
+}
+
+void chip8_vec_env_destroy(Chip8VecEnv* env) {
+  if (!env) {
+    return;
+  }
+  chip8_engine_destroy(env->engine);
+  free(env->rom);
+  free(env);
+}
+
+int chip8_vec_env_count(const Chip8VecEnv* env) {
+  assert(env);
+  return env->count;
+}
+
+size_t chip8_vec_env_buffer_size(const Chip8VecEnv* env) {
+  assert(env);
+  return (size_t)env->count * (CHIP8_VEC_ENV_PIXELS_SIZE + 1);
+}
+
+Chip8* chip8_vec_env_instance(Chip8VecEnv* env, int index) {
+  assert(env);
+  return chip8_engine_instance(env->engine, index);
+}
+
+void chip8_vec_env_set_quirks(Chip8VecEnv* env, uint8_t quirks) {
+  assert(env);
+  env->quirks = quirks;
+  for (int i = 0; i < env->count; i++) {
+    chip8_set_quirks(chip8_engine_instance(env->engine, i), quirks);
+  }
+}
+
+void chip8_vec_env_set_ipf(Chip8VecEnv* env, long ipf) {
+  assert(env);
+  assert(ipf > 0);
+  env->ipf = ipf;
+}
+
+void chip8_vec_env_set_reward_address(Chip8VecEnv* env, uint16_t address) {
+  assert(env);
+  env->reward_address = address;
+}
+
+void chip8_vec_env_reset(Chip8VecEnv* env, int index, uint64_t seed) {
+  assert(env);
+  Chip8* chip = chip8_engine_instance(env->engine, index);
+  chip8_init(chip);
+  chip8_seed(chip, seed);
+  chip8_set_quirks(chip, env->quirks);
+  // The size was checked when the environment was created
+  chip8_load_rom(chip, env->rom, env->size);
+}
+
+void chip8_vec_env_step(Chip8VecEnv* env, const uint16_t* keys, long frames, uint8_t* buffer) {
+  assert(env);
+  assert(keys);
+  assert(buffer);
+  assert(frames >= 0);
+
+  env->buffer = buffer;
+  for (int i = 0; i < env->count; i++) {
+    chip8_engine_instance(env->engine, i)->keys = keys[i];
+    chip8_engine_set_budget(env->engine, i, env->ipf, frames);
+  }
+  if (frames == 0) {
+    for (int i = 0; i < env->count; i++) {
+      observe(env, i, chip8_engine_instance(env->engine, i));
+    }
+  } else {
+    chip8_engine_run(env->engine, frames);
+  }
+  env->buffer = NULL;
+}
+
+
+// ----
+// Static functions
+
+static void observe(void* context, int index, Chip8* chip) {
+  // Runs on the worker that finished the instance, while its state is
+  // still in that core's cache
+  Chip8VecEnv* env = context;
+  memcpy(env->buffer + (size_t)index * CHIP8_VEC_ENV_PIXELS_SIZE, chip->pixels, CHIP8_VEC_ENV_PIXELS_SIZE);
+  env->buffer[(size_t)env->count * CHIP8_VEC_ENV_PIXELS_SIZE + index] = chip->memory[env->reward_address];
+}
@@ -0,0 +1,41 @@
+#ifndef VEC_ENV_H
+#define VEC_ENV_H
+
+#include "chip8.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Batch of copies of one ROM stepped together, for reinforcement learning.
+// One step call holds a key mask per instance for a number of frames and
+// leaves an observation of every instance in a buffer owned by the caller.
+// The engine workers write each observation straight from their instance
+// when its last frame is done, nothing is copied twice or allocated.
+//
+// Buffer layout for count instances, sized by chip8_vec_env_buffer_size:
+//   count * CHIP8_VEC_ENV_PIXELS_SIZE  the pixels[] of every instance
+//   count bytes                        memory[reward address] of every instance
+#define CHIP8_VEC_ENV_PIXELS_SIZE (DISPLAY_PLANES * DISPLAY_HEGIHT * ROW_WORDS * 8)
+
+typedef struct Chip8VecEnv Chip8VecEnv;
+
+// Loads rom, which can not be empty, into count instances seeded seed,
+// seed + 1 and so on.
+// thread_count <= 0 uses one thread per online CPU, returns NULL on failure.
+Chip8VecEnv* chip8_vec_env_create(int count, int thread_count, const uint8_t* rom, size_t size, uint64_t seed);
+void chip8_vec_env_destroy(Chip8VecEnv* env);
+
+int chip8_vec_env_count(const Chip8VecEnv* env);
+size_t chip8_vec_env_buffer_size(const Chip8VecEnv* env);
+Chip8* chip8_vec_env_instance(Chip8VecEnv* env, int index);
+// Apply to every instance and to later resets
+void chip8_vec_env_set_quirks(Chip8VecEnv* env, uint8_t quirks);
+void chip8_vec_env_set_ipf(Chip8VecEnv* env, long ipf);
+void chip8_vec_env_set_reward_address(Chip8VecEnv* env, uint16_t address);
+// Starts an instance over from the ROM
+void chip8_vec_env_reset(Chip8VecEnv* env, int index, uint64_t seed);
+// Holds keys[i] on instance i for frames frames, then writes the
+// observations to buffer. frames 0 only observes.
+void chip8_vec_env_step(Chip8VecEnv* env, const uint16_t* keys, long frames, uint8_t* buffer);
+
+#endif
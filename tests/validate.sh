@@ -0,0 +1,37 @@
+#!/bin/sh
+# Usage: validate.sh <headless> <headless with CHIP8_JIT_FAULT>
+# -b validate has to pass on the correct JIT and exit nonzero on the broken
+# one, which adds one too many in 7xkk.
+headless=$1
+faulty=$2
+rom=$(mktemp)
+trap 'rm -f "$rom"' EXIT
+
+# 200: 7001 ADD V0, 1
+# 202: 1200 JP 200
+printf '\160\001\022\000' > "$rom"
+
+if ! "$headless" -q -b validate -f 10 "$rom"; then
+  echo "FAIL: -b validate failed on the correct JIT"
+  exit 1
+fi
+if "$faulty" -q -b validate -f 10 "$rom"; then
+  echo "FAIL: -b validate passed on a diverging JIT"
+  exit 1
+fi
+
+# Code translated at 000 is then overwritten by a store wrapping around
+# the end of memory, the JIT has to drop the block
+# 200: 6075 6101 6200 63EE  V0..V3 = 75 01 00 EE
+# 208: A000 F355            store ADD V5, 1; RET at 000
+# 20C: 2000 2000            CALL 000 twice
+# 210: 6276 6301            V2, V3 = 76 01
+# 214: F000 FFFE F355       store from FFFE, ADD V6, 1 lands at 000
+# 21A: 2000 121C            CALL 000, then loop
+printf '\140\165\141\001\142\000\143\356\240\000\363\125\040\000\040\000' > "$rom"
+printf '\142\166\143\001\360\000\377\376\363\125\040\000\022\034' >> "$rom"
+if ! "$headless" -q -b validate -p 100 -f 3 "$rom"; then
+  echo "FAIL: -b validate failed on a store wrapping into translated code"
+  exit 1
+fi
+echo "PASS"